@@ -0,0 +1,577 @@
+// thready_bench.c
+//
+// https://github.com/tylerneylon/thready
+//
+// Latency and throughput benchmarks for thready messaging.
+//
+// Usage: thready_bench [-s] [-j] [-r num_round_trips]
+//                      [num_threads] [msgs_per_thread]
+//
+// The -s flag runs actors with the thready__shared_queue scheduling policy
+// instead of the default work-stealing policy. The -j flag prints the results
+// as a json object instead of as text. The -r flag sets the number of round
+// trips timed by the ping-pong benchmark; the default is 100000.
+//
+// num_threads is the number of producers, consumers or ring members, as fits
+// each benchmark; it defaults to 100. msgs_per_thread defaults to 1000.
+//
+
+#include "thready/thready.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Timing and reporting
+
+static double now_in_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int is_json      = 0;
+static int num_reported = 0;
+
+// Prints the start of a result, which is a line of text or a json object.
+static void begin_result(const char *name) {
+  if (is_json) {
+    printf("%s\n    {\"name\": \"%s\"", num_reported ? "," : "", name);
+  } else {
+    printf("%s: ", name);
+  }
+  num_reported++;
+}
+
+// Reports a throughput result; unit names what was counted, such as "msg".
+static void report(const char *name, int num_threads, int num_per_thread,
+                   const char *unit, double elapsed) {
+  double num_ops = (double)num_threads * num_per_thread;
+  begin_result(name);
+  if (is_json) {
+    printf(", \"threads\": %d, \"per_thread\": %d, \"unit\": \"%s\", "
+           "\"sec\": %.6f, \"per_sec\": %.0f}",
+           num_threads, num_per_thread, unit, elapsed, num_ops / elapsed);
+  } else {
+    if (num_threads > 1) printf("%d threads x ", num_threads);
+    printf("%d %s: %.3f sec, %.0f %s/sec\n",
+           num_per_thread, unit, elapsed, num_ops / elapsed, unit);
+  }
+}
+
+static int compare_int64s(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Reports percentiles of the given samples, in nanoseconds, as microseconds.
+// This sorts the samples.
+static void report_latency(const char *name, int64_t *samples, int n) {
+  qsort(samples, n, sizeof(int64_t), compare_int64s);
+  double total = 0;
+  for (int i = 0; i < n; ++i) total += samples[i];
+
+  double mean = total / n / 1e3;
+  double p50  = samples[(int)(0.5   * (n - 1))] / 1e3;
+  double p99  = samples[(int)(0.99  * (n - 1))] / 1e3;
+  double p999 = samples[(int)(0.999 * (n - 1))] / 1e3;
+
+  begin_result(name);
+  if (is_json) {
+    printf(", \"round_trips\": %d, \"mean_usec\": %.3f, \"p50_usec\": %.3f, "
+           "\"p99_usec\": %.3f, \"p999_usec\": %.3f}",
+           n, mean, p50, p99, p999);
+  } else {
+    printf("%d round trips: mean %.2f, p50 %.2f, p99 %.2f, p999 %.2f "
+           "usec/round trip\n", n, mean, p50, p99, p999);
+  }
+}
+
+// Benchmarks that work with either OS threads or actors take one of these.
+typedef thready__Id (*Creator)(thready__Receiver receiver);
+
+static thready__Id main_id;
+static int         num_main_recd;
+
+void main_get_msg(void *msg, thready__Id from) {
+  num_main_recd++;
+}
+
+static void wait_for_main_msgs(int num_msgs) {
+  while (num_main_recd < num_msgs) {
+    thready__runloop(main_get_msg, thready__blocking);
+  }
+  num_main_recd = 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Ping-pong benchmark
+
+// The main thread and one other thread pass a message back and forth, so
+// each round trip pays for two wake-ups. Each round trip is timed separately.
+
+void pong(void *msg, thready__Id from) {
+  thready__send(msg, from);
+}
+
+void ping_get_msg(void *msg, thready__Id from) {}
+
+static void ping_pong_bench(int num_round_trips) {
+  thready__Id other = thready__create(pong);
+  int64_t *samples  = malloc(num_round_trips * sizeof(int64_t));
+
+  for (int i = 0; i < num_round_trips; ++i) {
+    int64_t start = thready__now_ns();
+    thready__send(NULL, other);
+    thready__runloop(ping_get_msg, thready__blocking);
+    samples[i] = thready__now_ns() - start;
+  }
+
+  report_latency("ping_pong", samples, num_round_trips);
+  free(samples);
+}
+
+// This is the same exchange with thready__call, whose reply goes straight to
+// a future instead of through the main thread's inbox.
+
+void call_server(void *msg, thready__Id from) {
+  thready__reply(msg);
+}
+
+static void call_bench(int num_round_trips) {
+  thready__Id other = thready__create(call_server);
+  int64_t *samples  = malloc(num_round_trips * sizeof(int64_t));
+
+  for (int i = 0; i < num_round_trips; ++i) {
+    int64_t start = thready__now_ns();
+    thready__future_wait(thready__call(NULL, other), -1, NULL);
+    samples[i] = thready__now_ns() - start;
+  }
+
+  report_latency("call", samples, num_round_trips);
+  free(samples);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Fan-in benchmarks
+
+// Many producers each send a batch of messages into a single receiver, which
+// is either the main thread or an actor.
+
+static thready__Id fan_in_consumer_id;
+static int         fan_in_msg_per_producer;
+static int         fan_in_msg_goal;
+static int         fan_in_num_recd;  // Only touched by the consumer.
+
+void fan_in_producer(void *msg, thready__Id from) {
+  for (int i = 0; i < fan_in_msg_per_producer; ++i) {
+    thready__send(NULL, fan_in_consumer_id);
+  }
+}
+
+// This sends the same messages with thready__send_many in batches.
+#define batch_size 100
+
+void fan_in_batched_producer(void *msg, thready__Id from) {
+  void *msgs[batch_size] = { NULL };
+  for (int i = 0; i < fan_in_msg_per_producer; i += batch_size) {
+    int count = fan_in_msg_per_producer - i;
+    if (count > batch_size) count = batch_size;
+    thready__send_many(msgs, count, fan_in_consumer_id);
+  }
+}
+
+void fan_in_main_get_msg(void *msg, thready__Id from) {
+  fan_in_num_recd++;
+}
+
+void fan_in_consumer(void *msg, thready__Id from) {
+  if (++fan_in_num_recd == fan_in_msg_goal) thready__send(NULL, main_id);
+}
+
+static thready__Id *create_all(Creator create, thready__Receiver receiver,
+                               int n) {
+  thready__Id *ids = malloc(n * sizeof(thready__Id));
+  for (int i = 0; i < n; ++i) ids[i] = create(receiver);
+  return ids;
+}
+
+static void fan_in_bench(const char *name, thready__Receiver producer,
+                         int num_producers, int msg_per_producer) {
+  fan_in_consumer_id      = main_id;
+  fan_in_msg_per_producer = msg_per_producer;
+  fan_in_msg_goal         = num_producers * msg_per_producer;
+  fan_in_num_recd         = 0;
+
+  thready__Id *ids = create_all(thready__create, producer, num_producers);
+
+  double start = now_in_sec();
+  for (int i = 0; i < num_producers; ++i) thready__send(NULL, ids[i]);
+  while (fan_in_num_recd < fan_in_msg_goal) {
+    thready__runloop(fan_in_main_get_msg, thready__blocking);
+  }
+  report(name, num_producers, msg_per_producer, "msg", now_in_sec() - start);
+
+  free(ids);
+}
+
+static void actor_fan_in_bench(int num_producers, int msg_per_producer) {
+  fan_in_consumer_id      = thready__spawn(fan_in_consumer);
+  fan_in_msg_per_producer = msg_per_producer;
+  fan_in_msg_goal         = num_producers * msg_per_producer;
+  fan_in_num_recd         = 0;
+
+  thready__Id *ids = create_all(thready__spawn, fan_in_producer,
+                                num_producers);
+
+  double start = now_in_sec();
+  for (int i = 0; i < num_producers; ++i) thready__send(NULL, ids[i]);
+  wait_for_main_msgs(1);
+  report("actor_fan_in", num_producers, msg_per_producer, "msg",
+         now_in_sec() - start);
+
+  free(ids);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Fan-out benchmark
+
+// A single producer sends a batch of messages to each of many consumers. Each
+// consumer gets a pointer to its own counter as its messages.
+
+static thready__Id *fan_out_ids;
+static int         *fan_out_counts;
+static int          fan_out_num_consumers;
+static int          fan_out_msg_per_consumer;
+static int          fan_out_num_done;
+
+void fan_out_consumer(void *msg, thready__Id from) {
+  int *num_recd = (int *)msg;
+  if (++*num_recd < fan_out_msg_per_consumer) return;
+  if (__atomic_add_fetch(&fan_out_num_done, 1, __ATOMIC_SEQ_CST) ==
+      fan_out_num_consumers) {
+    thready__send(NULL, main_id);
+  }
+}
+
+void fan_out_producer(void *msg, thready__Id from) {
+  for (int i = 0; i < fan_out_msg_per_consumer; ++i) {
+    for (int j = 0; j < fan_out_num_consumers; ++j) {
+      thready__send(fan_out_counts + j, fan_out_ids[j]);
+    }
+  }
+}
+
+static void fan_out_bench(const char *name, Creator create, int num_consumers,
+                          int msg_per_consumer) {
+  fan_out_num_consumers    = num_consumers;
+  fan_out_msg_per_consumer = msg_per_consumer;
+  fan_out_num_done         = 0;
+
+  fan_out_ids    = create_all(create, fan_out_consumer, num_consumers);
+  fan_out_counts = calloc(num_consumers, sizeof(int));
+  thready__Id producer = create(fan_out_producer);
+
+  double start = now_in_sec();
+  thready__send(NULL, producer);
+  wait_for_main_msgs(1);
+  report(name, num_consumers, msg_per_consumer, "msg", now_in_sec() - start);
+
+  free(fan_out_ids);
+  free(fan_out_counts);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Channel benchmark
+
+// A single producer sends to the main thread through a channel. Compare this
+// with fan_in run with one producer, which sends the same messages with
+// thready__send.
+
+#define channel_capacity 1024
+
+static thready__Channel *channel;
+
+void channel_producer(void *msg, thready__Id from) {
+  for (int i = 0; i < fan_in_msg_per_producer; ++i) {
+    thready__channel_send(channel, NULL);
+  }
+}
+
+static void channel_bench(int num_msgs) {
+  fan_in_msg_per_producer = num_msgs;
+  fan_in_num_recd         = 0;
+
+  channel = thready__channel_new(channel_capacity, main_id);
+  thready__Id producer = thready__create(channel_producer);
+
+  double start = now_in_sec();
+  thready__send(NULL, producer);
+  while (fan_in_num_recd < num_msgs) {
+    thready__runloop(fan_in_main_get_msg, thready__blocking);
+  }
+  report("channel", 1, num_msgs, "msg", now_in_sec() - start);
+
+  thready__channel_delete(channel);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Pipeline benchmarks
+
+// The main thread pushes items through three stages that do no work, and
+// receives them at the end. The chain version hand-wires the same stages
+// with thready__send, one message per item per stage.
+
+#define num_stages 3
+
+static thready__Id chain_ids[num_stages + 1];  // The last one is main_id.
+static int         pipeline_is_done;
+
+void chain_stage(void *msg, thready__Id from) {
+  int i = 0;
+  while (chain_ids[i] != thready__my_id()) i++;
+  thready__send(msg, chain_ids[i + 1]);
+}
+
+void pipeline_stage(void *item, thready__Id from) {
+  if (from != thready__end_of_stream) thready__pipeline_emit(item);
+}
+
+void pipeline_main_get_msg(void *msg, thready__Id from) {
+  if (from == thready__end_of_stream) pipeline_is_done = 1;
+}
+
+static void chain_bench(int num_items) {
+  for (int i = 0; i < num_stages; ++i) {
+    chain_ids[i] = thready__create(chain_stage);
+  }
+  chain_ids[num_stages] = main_id;
+
+  double start = now_in_sec();
+  for (int i = 0; i < num_items; ++i) thready__send(NULL, chain_ids[0]);
+  wait_for_main_msgs(num_items);
+  report("chain", num_stages, num_items, "hop", now_in_sec() - start);
+}
+
+static void pipeline_bench(int num_items) {
+  thready__Pipeline *pipeline = thready__pipeline_new(0, 0, main_id);
+  for (int i = 0; i < num_stages; ++i) {
+    thready__pipeline_add_stage(pipeline, pipeline_stage, 1);
+  }
+  pipeline_is_done = 0;
+
+  double start = now_in_sec();
+  for (int i = 0; i < num_items; ++i) thready__pipeline_push(pipeline, NULL);
+  thready__pipeline_close(pipeline);
+  while (!pipeline_is_done) {
+    thready__runloop(pipeline_main_get_msg, thready__blocking);
+  }
+  report("pipeline", num_stages, num_items, "hop", now_in_sec() - start);
+
+  thready__pipeline_delete(pipeline);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Publish benchmark
+
+// The main thread publishes payloads to a topic with many actor subscribers.
+// Every subscriber gets the same payload, without a copy.
+
+#define payload_size 256
+
+static int publish_msg_goal;
+static int publish_num_recd;
+
+void publish_subscriber(void *msg, thready__Id from) {
+  thready__shared_release(msg);
+  if (__atomic_add_fetch(&publish_num_recd, 1, __ATOMIC_SEQ_CST) ==
+      publish_msg_goal) {
+    thready__send(NULL, main_id);
+  }
+}
+
+static void publish_bench(int num_subscribers, int msg_per_subscriber) {
+  publish_msg_goal = num_subscribers * msg_per_subscriber;
+  publish_num_recd = 0;
+
+  thready__Topic *topic = thready__topic_new();
+  thready__Id *ids = create_all(thready__spawn, publish_subscriber,
+                                num_subscribers);
+  for (int i = 0; i < num_subscribers; ++i) {
+    thready__topic_subscribe(topic, ids[i]);
+  }
+
+  double start = now_in_sec();
+  for (int i = 0; i < msg_per_subscriber; ++i) {
+    void *payload = thready__shared_alloc(payload_size);
+    memset(payload, i, payload_size);
+    thready__topic_publish(topic, payload);
+    thready__shared_release(payload);
+  }
+  wait_for_main_msgs(1);
+  report("publish", num_subscribers, msg_per_subscriber, "msg",
+         now_in_sec() - start);
+
+  thready__topic_delete(topic);
+  free(ids);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Ring benchmark
+
+// A single token is passed around a ring of threads for a number of laps, so
+// that every hop is a wake-up of a different thread.
+
+typedef struct {
+  int position;
+  int hops_left;
+} Token;
+
+static thready__Id *ring_ids;
+static int          ring_size;
+
+void ring_member(void *msg, thready__Id from) {
+  Token *token = (Token *)msg;
+  if (--token->hops_left == 0) {
+    thready__send(token, main_id);
+    return;
+  }
+  token->position = (token->position + 1) % ring_size;
+  thready__send(token, ring_ids[token->position]);
+}
+
+static void ring_bench(const char *name, Creator create, int num_members,
+                       int num_laps) {
+  ring_size = num_members;
+  ring_ids  = create_all(create, ring_member, num_members);
+
+  Token token = { .position = 0, .hops_left = num_members * num_laps };
+
+  double start = now_in_sec();
+  thready__send(&token, ring_ids[0]);
+  wait_for_main_msgs(1);
+  report(name, num_members, num_laps, "hop", now_in_sec() - start);
+
+  free(ring_ids);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Creation benchmarks
+
+// This times how quickly threads or actors can be created. Each one exits when
+// it receives its first message, which is sent after the timing ends.
+
+void exit_on_msg(void *msg, thready__Id from) {
+  thready__exit();
+}
+
+static void create_bench(const char *name, Creator create, int num_threads) {
+  double start = now_in_sec();
+  thready__Id *ids = create_all(create, exit_on_msg, num_threads);
+  report(name, 1, num_threads, "thread", now_in_sec() - start);
+
+  for (int i = 0; i < num_threads; ++i) thready__send(NULL, ids[i]);
+  free(ids);
+}
+
+// Here many threads call thready__create_once with the same receiver at once.
+
+static int create_once_calls_per_thread;
+
+void create_once_target(void *msg, thready__Id from) {}
+
+void create_once_caller(void *msg, thready__Id from) {
+  for (int i = 0; i < create_once_calls_per_thread; ++i) {
+    thready__create_once(create_once_target);
+  }
+  thready__send(NULL, main_id);
+}
+
+static void create_once_bench(int num_threads, int calls_per_thread) {
+  create_once_calls_per_thread = calls_per_thread;
+  thready__Id *ids = create_all(thready__create, create_once_caller,
+                                num_threads);
+
+  double start = now_in_sec();
+  for (int i = 0; i < num_threads; ++i) thready__send(NULL, ids[i]);
+  wait_for_main_msgs(num_threads);
+  report("create_once", num_threads, calls_per_thread, "call",
+         now_in_sec() - start);
+
+  free(ids);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Main
+
+int main(int argc, char **argv) {
+  int use_shared_queue = 0;
+  int num_round_trips  = 100000;
+
+  // Flags come before the positional arguments.
+  for (argc--, argv++; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+    if (strcmp(argv[0], "-s") == 0) {
+      use_shared_queue = 1;
+    } else if (strcmp(argv[0], "-j") == 0) {
+      is_json = 1;
+    } else if (strcmp(argv[0], "-r") == 0 && argc > 1) {
+      num_round_trips = atoi(argv[1]);
+      argc--;
+      argv++;
+    } else {
+      fprintf(stderr, "Usage: thready_bench [-s] [-j] [-r num_round_trips] "
+                      "[num_threads] [msgs_per_thread]\n");
+      return 1;
+    }
+  }
+  int num_threads     = argc > 0 ? atoi(argv[0]) : 100;
+  int msgs_per_thread = argc > 1 ? atoi(argv[1]) : 1000;
+  if (num_round_trips < 1 || num_threads < 1 || msgs_per_thread < 1) {
+    fprintf(stderr, "thready_bench: counts must be positive\n");
+    return 1;
+  }
+
+  if (use_shared_queue) thready__set_scheduling(thready__shared_queue);
+  const char *scheduling = use_shared_queue ? "shared_queue" : "work_stealing";
+  if (is_json) {
+    printf("{\"scheduling\": \"%s\", \"results\": [", scheduling);
+  } else {
+    printf("Actor scheduling: %s\n", scheduling);
+  }
+
+  main_id = thready__my_id();
+
+  ping_pong_bench(num_round_trips);
+  call_bench(num_round_trips);
+  fan_in_bench("fan_in", fan_in_producer, num_threads, msgs_per_thread);
+  fan_in_bench("fan_in_batched", fan_in_batched_producer,
+               num_threads, msgs_per_thread);
+  actor_fan_in_bench(num_threads, msgs_per_thread);
+  fan_in_bench("spsc_send", fan_in_producer, 1, num_threads * msgs_per_thread);
+  channel_bench(num_threads * msgs_per_thread);
+  chain_bench(num_threads * msgs_per_thread);
+  pipeline_bench(num_threads * msgs_per_thread);
+  fan_out_bench("fan_out", thready__create, num_threads, msgs_per_thread);
+  fan_out_bench("actor_fan_out", thready__spawn, num_threads, msgs_per_thread);
+  publish_bench(num_threads, msgs_per_thread);
+  ring_bench("ring", thready__create, num_threads, msgs_per_thread);
+  ring_bench("actor_ring", thready__spawn, num_threads, msgs_per_thread);
+  create_bench("create", thready__create, num_threads);
+  create_bench("spawn", thready__spawn, num_threads);
+  create_once_bench(num_threads, msgs_per_thread);
+
+  if (is_json) printf("\n]}\n");
+  return 0;
+}
@@ -18,6 +18,15 @@
 #include "winutil.h"
 #endif
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
 #pragma warning (disable : 4244)
 
 
@@ -250,6 +259,1466 @@ int create_once_test() {
   return test_success;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Backlog test
+
+#define backlog_size 100000
+
+static int num_backlog_recd = 0;
+static thready__Id backlog_main_id;
+
+void backlog_get_msg(void *msg, thready__Id from) {
+  if (from != thready__my_id()) {
+    // This is the start signal from the main thread. Build up a large backlog
+    // in our own inbox; it should drain in order.
+    for (int i = 0; i < backlog_size; ++i) {
+      thready__send((void *)(intptr_t)i, thready__my_id());
+    }
+    return;
+  }
+
+  int msg_int = (int)(intptr_t)msg;
+  test_that(msg_int == num_backlog_recd);
+  num_backlog_recd++;
+
+  // A nested runloop should continue the outer batch in order.
+  if (msg_int == backlog_size / 2) {
+    thready__runloop(backlog_get_msg, thready__nonblocking);
+  }
+
+  if (num_backlog_recd == backlog_size) thready__send(NULL, backlog_main_id);
+}
+
+int backlog_test() {
+  backlog_main_id = thready__my_id();
+  thready__Id other = thready__create(backlog_get_msg);
+  thready__send(NULL, other);
+
+  while (num_backlog_recd < backlog_size) {
+    thready__runloop(do_nothing_receiver, thready__blocking);
+  }
+  test_that(num_backlog_recd == backlog_size);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Bounded inbox test
+
+#define bounded_capacity 4
+#define num_bounded_msgs 1000
+
+static int bounded_is_released = 0;
+static int num_bounded_recd = 0;
+static thready__Id bounded_main_id;
+
+void bounded_get_msg(void *msg, thready__Id from) {
+  // Hold up the first message until the main thread has filled our inbox.
+  while (!__atomic_load_n(&bounded_is_released, __ATOMIC_SEQ_CST)) {
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+    nanosleep(&delay, NULL);
+  }
+  num_bounded_recd++;
+  if (msg) thready__send(msg, bounded_main_id);
+}
+
+static int bounded_is_done = 0;
+
+void bounded_main_get_msg(void *msg, thready__Id from) {
+  if (msg == &num_bounded_recd) bounded_is_done = 1;
+}
+
+int bounded_test() {
+  bounded_main_id = thready__my_id();
+  thready__Id other = thready__create_bounded(bounded_get_msg, bounded_capacity);
+  test_that(other != thready__error);
+
+  // The first message may or may not have been taken out of the inbox by the
+  // time the inbox fills up.
+  int num_sent = 0;
+  while (thready__try_send(NULL, other) == thready__success) num_sent++;
+  test_that(num_sent == bounded_capacity || num_sent == bounded_capacity + 1);
+  test_that(thready__try_send(NULL, other) == thready__full);
+
+  // Blocking sends should wait for room instead of failing.
+  __atomic_store_n(&bounded_is_released, 1, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < num_bounded_msgs - 1; ++i) {
+    test_that(thready__send(NULL, other) == thready__success);
+  }
+  thready__send(&num_bounded_recd, other);  // Ask for a reply at the end.
+  while (!bounded_is_done) {
+    thready__runloop(bounded_main_get_msg, thready__blocking);
+  }
+  test_that(num_bounded_recd == num_sent + num_bounded_msgs);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Send many test
+
+#define num_many_kids 4
+#define num_many_msgs 1000
+
+static thready__Id many_main_id;
+static int many_next_seq[num_many_kids];
+
+// Messages encode (kid_index, seq) so each kid can check it gets its own
+// messages in order.
+void many_kid_get_msg(void *msg, thready__Id from) {
+  int msg_int = (int)(intptr_t)msg;
+  int kid = msg_int / num_many_msgs;
+  int seq = msg_int % num_many_msgs;
+  test_that(seq == many_next_seq[kid]);
+  many_next_seq[kid]++;
+  if (seq == num_many_msgs - 1) thready__send(NULL, many_main_id);
+}
+
+static int num_many_kids_done = 0;
+
+void many_main_get_msg(void *msg, thready__Id from) {
+  num_many_kids_done++;
+}
+
+int send_many_test() {
+  many_main_id = thready__my_id();
+
+  thready__Id ids[num_many_kids];
+  for (int i = 0; i < num_many_kids; ++i) {
+    // Use a small bounded inbox for one kid so the batch is split up.
+    ids[i] = i ? thready__create(many_kid_get_msg)
+               : thready__create_bounded(many_kid_get_msg, 16);
+  }
+
+  // Send all of kid 0's messages in one call.
+  void *msgs[num_many_msgs * num_many_kids];
+  for (int i = 0; i < num_many_msgs; ++i) msgs[i] = (void *)(intptr_t)i;
+  test_that(thready__send_many(msgs, num_many_msgs, ids[0]) == thready__success);
+
+  // A bad id fails a scatter before anything is sent, so kid 1 won't see this
+  // message twice.
+  thready__Id to_ids[num_many_msgs * num_many_kids];
+  msgs[0]   = (void *)(intptr_t)num_many_msgs;
+  to_ids[0] = ids[1];
+  msgs[1]   = NULL;
+  to_ids[1] = thready__error;
+  test_that(thready__send_scatter(msgs, to_ids, 2) == thready__error);
+
+  // Interleave the messages for the other kids and scatter them.
+  int count = 0;
+  for (int seq = 0; seq < num_many_msgs; ++seq) {
+    for (int kid = 1; kid < num_many_kids; ++kid) {
+      msgs[count]   = (void *)(intptr_t)(kid * num_many_msgs + seq);
+      to_ids[count] = ids[kid];
+      count++;
+    }
+  }
+  test_that(thready__send_scatter(msgs, to_ids, count) == thready__success);
+
+  while (num_many_kids_done < num_many_kids) {
+    thready__runloop(many_main_get_msg, thready__blocking);
+  }
+  for (int i = 0; i < num_many_kids; ++i) {
+    test_that(many_next_seq[i] == num_many_msgs);
+  }
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Spawn test
+
+#define num_actors 100000
+
+static int num_actor_replies = 0;
+
+void actor_get_msg(void *msg, thready__Id from) {
+  // Actors should see their own id, not a worker's.
+  test_that(thready__my_id() == msg);
+  thready__send(NULL, from);
+}
+
+void actor_get_msg_and_exit(void *msg, thready__Id from) {
+  thready__send(NULL, from);
+  thready__exit();
+  test_failed("We shouldn't get here since it's after thready__exit.\n");
+}
+
+void spawn_main_get_msg(void *msg, thready__Id from) {
+  num_actor_replies++;
+}
+
+int spawn_test() {
+
+  // Use several workers, even on a single cpu, so they steal from each other.
+  test_that(thready__set_num_workers(4) == thready__success);
+
+  // Many more actors than we could run as OS threads.
+  thready__Id *ids = malloc(num_actors * sizeof(thready__Id));
+  for (int i = 0; i < num_actors; ++i) {
+    ids[i] = thready__spawn(actor_get_msg);
+    test_that(ids[i] != thready__error);
+  }
+  for (int i = 0; i < num_actors; ++i) thready__send(ids[i], ids[i]);
+
+  thready__Id exiting_id = thready__spawn(actor_get_msg_and_exit);
+  thready__send(NULL, exiting_id);
+
+  while (num_actor_replies < num_actors + 1) {
+    thready__runloop(spawn_main_get_msg, thready__blocking);
+  }
+  test_that(num_actor_replies == num_actors + 1);
+
+  // The worker pool is already running, so its size is fixed.
+  test_that(thready__set_num_workers(2) == thready__error);
+  test_that(thready__set_scheduling(thready__shared_queue) == thready__error);
+
+  free(ids);
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Actor ring test
+
+#define ring_size           100
+#define num_tokens          8
+#define hops_per_token      10000
+#define hops_per_token_mult 1000000
+
+static thready__Id ring_ids[ring_size];
+static thready__Id ring_main_id;
+
+// Messages encode (token, hop). Hop h of token t is received by the actor at
+// index (t + h) % ring_size.
+void ring_get_msg(void *msg, thready__Id from) {
+  int msg_int = (int)(intptr_t)msg;
+  int token = msg_int / hops_per_token_mult;
+  int hop   = msg_int % hops_per_token_mult;
+  test_that(thready__my_id() == ring_ids[(token + hop) % ring_size]);
+  if (hop == hops_per_token) {
+    thready__send(NULL, ring_main_id);
+    return;
+  }
+  thready__send((void *)(intptr_t)(msg_int + 1),
+                ring_ids[(token + hop + 1) % ring_size]);
+}
+
+static int num_tokens_done = 0;
+
+void ring_main_get_msg(void *msg, thready__Id from) {
+  num_tokens_done++;
+}
+
+int actor_ring_test() {
+
+  // Several tokens travel around a ring of actors at once. Actors sending to
+  // actors exercise the workers' own deques and stealing.
+
+  ring_main_id = thready__my_id();
+  for (int i = 0; i < ring_size; ++i) ring_ids[i] = thready__spawn(ring_get_msg);
+  for (int t = 0; t < num_tokens; ++t) {
+    thready__send((void *)(intptr_t)(t * hops_per_token_mult), ring_ids[t]);
+  }
+  while (num_tokens_done < num_tokens) {
+    thready__runloop(ring_main_get_msg, thready__blocking);
+  }
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Timer test
+
+#define ms 1000000
+
+// Messages are pointers into this array, so that we can tell them apart from
+// stray messages left over from earlier tests.
+static int timer_msgs[6];
+#define periodic_msg  (timer_msgs + 3)
+#define cancelled_msg (timer_msgs + 4)
+#define last_msg      (timer_msgs + 5)
+
+static int timer_order[3];
+static int num_timer_recd = 0;
+static int num_periodic_recd = 0;
+static int num_cancelled_recd = 0;
+static int timer_is_done = 0;
+
+void timer_get_msg(void *msg, thready__Id from) {
+  int is_timer_msg = (msg >= (void *)timer_msgs && msg <= (void *)last_msg);
+  if (is_timer_msg) test_that(from == thready__my_id());
+  if (msg == periodic_msg)  num_periodic_recd++;
+  if (msg == cancelled_msg) num_cancelled_recd++;
+  if (msg == last_msg)      timer_is_done = 1;
+  for (int i = 0; i < 3; ++i) {
+    if (msg == timer_msgs + i) timer_order[num_timer_recd++] = i;
+  }
+}
+
+int timer_test() {
+
+  // One-shot timers arrive in order of their delays, not of their creation.
+  int64_t delays[3] = { 30 * ms, 10 * ms, 20 * ms };
+  thready__Timer timers[3];
+  for (int i = 0; i < 3; ++i) {
+    timers[i] = thready__send_after(timer_msgs + i, thready__my_id(), delays[i]);
+    test_that(timers[i] != 0);
+  }
+  thready__Timer periodic = thready__send_every(periodic_msg,
+                                                thready__my_id(), 2 * ms);
+  thready__Timer cancelled = thready__send_after(cancelled_msg,
+                                                 thready__my_id(), 5 * ms);
+  test_that(thready__cancel_timer(cancelled) == thready__success);
+  test_that(thready__cancel_timer(cancelled) == thready__error);
+
+  // Handles that were never issued are rejected too. The first is an unused
+  // timer; the second is the cancelled timer's next generation.
+  test_that(thready__cancel_timer(1000) == thready__error);
+  thready__Timer next_generation = cancelled + ((thready__Timer)1 << 32);
+  test_that(thready__cancel_timer(next_generation) == thready__error);
+
+  // Huge delays are clamped rather than overflowing into the past.
+  thready__Timer huge_once = thready__send_after(cancelled_msg,
+                                                 thready__my_id(), INT64_MAX);
+  thready__Timer huge_every = thready__send_every(cancelled_msg,
+                                                  thready__my_id(), INT64_MAX);
+  test_that(huge_once != 0 && huge_every != 0);
+
+  while (num_timer_recd < 3 || num_periodic_recd < 3) {
+    thready__runloop(timer_get_msg, thready__blocking);
+  }
+  test_that(timer_order[0] == 1 && timer_order[1] == 2 && timer_order[2] == 0);
+
+  // Timers that have already fired can't be cancelled.
+  test_that(thready__cancel_timer(timers[0]) == thready__error);
+  test_that(thready__cancel_timer(periodic) == thready__success);
+  test_that(thready__cancel_timer(periodic) == thready__error);
+
+  thready__send_after(last_msg, thready__my_id(), 10 * ms);
+  while (!timer_is_done) thready__runloop(timer_get_msg, thready__blocking);
+  test_that(num_cancelled_recd == 0);
+  test_that(thready__cancel_timer(huge_once)  == thready__success);
+  test_that(thready__cancel_timer(huge_every) == thready__success);
+
+  test_that(thready__send_every(NULL, thready__my_id(), 0) == 0);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Bounded runloop test
+
+static int num_counted = 0;
+static thready__Id runloop_main_id;
+static int runloop_is_done = 0;
+
+void count_msg(void *msg, thready__Id from) {
+  num_counted++;
+}
+
+void runloop_kid_get_msg(void *msg, thready__Id from) {
+  // This runs in its own thread so that nothing else is in its inbox.
+  for (int i = 0; i < 10; ++i) thready__send(NULL, thready__my_id());
+
+  test_that(thready__runloop_budget(count_msg, 3, 0) != thready__error);
+  test_that(num_counted == 3);
+  test_that(thready__runloop_budget(count_msg, 0, 0) != thready__error);
+  test_that(num_counted == 10);
+
+  // With an empty inbox, runloop_until waits out its deadline.
+  int64_t start = thready__now_ns();
+  thready__runloop_until(count_msg, start + 20 * ms);
+  test_that(thready__now_ns() - start >= 20 * ms);
+  test_that(num_counted == 10);
+
+  // Messages that arrive before the deadline are handled.
+  thready__send_after(NULL, thready__my_id(), 5 * ms);
+  thready__runloop_until(count_msg, thready__now_ns() + 50 * ms);
+  test_that(num_counted == 11);
+
+  thready__send(&runloop_is_done, runloop_main_id);
+}
+
+void runloop_main_get_msg(void *msg, thready__Id from) {
+  if (msg == &runloop_is_done) runloop_is_done = 1;
+}
+
+int runloop_test() {
+  runloop_main_id = thready__my_id();
+  thready__send(NULL, thready__create(runloop_kid_get_msg));
+  while (!runloop_is_done) {
+    thready__runloop_until(runloop_main_get_msg, thready__now_ns() + 10 * ms);
+  }
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Message allocator test
+
+#define num_pool_msgs 10000
+
+static thready__Id pool_main_id;
+static int pool_is_done = 0;
+
+// Each message holds its own size, followed by bytes set to that size.
+static size_t pool_msg_size(int i) {
+  return sizeof(size_t) + (i * 37) % 5000;  // Some are too big for the pools.
+}
+
+void pool_kid_get_msg(void *msg, thready__Id from) {
+  if (msg == NULL) {
+    thready__send(&pool_is_done, pool_main_id);
+    return;
+  }
+  size_t size = *(size_t *)msg;
+  unsigned char *bytes = (unsigned char *)msg + sizeof(size_t);
+  for (size_t i = 0; i < size - sizeof(size_t); ++i) {
+    test_that(bytes[i] == (unsigned char)size);
+  }
+  test_that(((uintptr_t)msg & 15) == 0);
+  thready__msg_free(msg);
+}
+
+void pool_main_get_msg(void *msg, thready__Id from) {
+  if (msg == &pool_is_done) pool_is_done = 1;
+}
+
+int msg_pool_test() {
+  pool_main_id = thready__my_id();
+  thready__Id kid = thready__create(pool_kid_get_msg);
+
+  // The kid frees every message, so later rounds reuse returned blocks.
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < num_pool_msgs; ++i) {
+      size_t size = pool_msg_size(i);
+      size_t *msg = thready__msg_alloc(size);
+      test_that(msg != NULL);
+      *msg = size;
+      memset(msg + 1, (unsigned char)size, size - sizeof(size_t));
+      thready__send(msg, kid);
+    }
+    pool_is_done = 0;
+    thready__send(NULL, kid);
+    while (!pool_is_done) thready__runloop(pool_main_get_msg, thready__blocking);
+  }
+
+  // Freeing a block in the thread that allocated it is fine too.
+  void *msg = thready__msg_alloc(100);
+  test_that(msg != NULL);
+  thready__msg_free(msg);
+  thready__msg_free(NULL);
+
+  // Blocks of 64 bytes or more start on a cache line, and each message
+  // follows a 16-byte header in its block.
+  for (size_t size = 48; size <= 4096; size *= 2) {
+    msg = thready__msg_alloc(size);
+    test_that((uintptr_t)msg % 64 == 16);
+    thready__msg_free(msg);
+  }
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Send copy test
+
+#define num_copy_msgs 1000
+
+typedef struct {
+  int    seq;
+  double values[4];
+} CopyMsg;
+
+static thready__Id copy_main_id;
+static int copy_is_done = 0;
+static int num_copy_recd = 0;
+
+void copy_kid_get_msg(void *msg, thready__Id from) {
+  if (msg == NULL) {
+    thready__send(&copy_is_done, copy_main_id);
+    return;
+  }
+  // Copies start 40 bytes into a cache line, so up to 24 bytes share the line
+  // with their envelope.
+  test_that((uintptr_t)msg % 64 == 40);
+  CopyMsg *copy = (CopyMsg *)msg;
+  test_that(copy->seq == num_copy_recd);
+  for (int i = 0; i < 4; ++i) test_that(copy->values[i] == copy->seq * i);
+  num_copy_recd++;
+}
+
+void copy_main_get_msg(void *msg, thready__Id from) {
+  if (msg == &copy_is_done) copy_is_done = 1;
+}
+
+int send_copy_test() {
+  copy_main_id = thready__my_id();
+  thready__Id kid = thready__create(copy_kid_get_msg);
+
+  // Each send copies the struct, so we can reuse it right away.
+  CopyMsg copy;
+  for (int i = 0; i < num_copy_msgs; ++i) {
+    copy.seq = i;
+    for (int j = 0; j < 4; ++j) copy.values[j] = i * j;
+    test_that(thready__send_copy(&copy, sizeof(copy), kid) == thready__success);
+  }
+
+  // A zero-length copy arrives as NULL.
+  thready__send_copy(&copy, 0, kid);
+  while (!copy_is_done) thready__runloop(copy_main_get_msg, thready__blocking);
+  test_that(num_copy_recd == num_copy_msgs);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Priority test
+
+#define num_urgent_msgs 40
+
+static int priority_is_released = 0;
+static int priority_order[num_urgent_msgs + 1];
+static int num_priority_recd = 0;
+static int num_priority_expected;
+static thready__Id priority_main_id;
+
+// Messages are priority + 1, so that NULL can mean "hold."
+void priority_get_msg(void *msg, thready__Id from) {
+  if (msg == NULL) {
+    // Hold up the inbox until the main thread has filled it.
+    while (!__atomic_load_n(&priority_is_released, __ATOMIC_SEQ_CST)) {
+      struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+      nanosleep(&delay, NULL);
+    }
+    return;
+  }
+  priority_order[num_priority_recd++] = (int)(intptr_t)msg - 1;
+  if (num_priority_recd == num_priority_expected) {
+    thready__send(&priority_is_released, priority_main_id);
+  }
+}
+
+static int priority_is_done = 0;
+
+void priority_main_get_msg(void *msg, thready__Id from) {
+  if (msg == &priority_is_released) priority_is_done = 1;
+}
+
+// Releases the kid, and waits until it has received `num_msgs` messages.
+static void priority_run(int num_msgs) {
+  priority_is_done = 0;
+  num_priority_expected = num_msgs;
+  __atomic_store_n(&priority_is_released, 1, __ATOMIC_SEQ_CST);
+  while (!priority_is_done) {
+    thready__runloop(priority_main_get_msg, thready__blocking);
+  }
+}
+
+int priority_test() {
+  priority_main_id = thready__my_id();
+  thready__Id kid = thready__create(priority_get_msg);
+
+  // Higher priorities are received first.
+  thready__send(NULL, kid);
+  for (int p = 0; p < thready__num_priorities; ++p) {
+    test_that(thready__send_priority((void *)(intptr_t)(p + 1), kid, p) ==
+              thready__success);
+  }
+  priority_run(thready__num_priorities);
+  for (int i = 0; i < thready__num_priorities; ++i) {
+    test_that(priority_order[i] == thready__num_priorities - 1 - i);
+  }
+
+  // A steady stream of urgent messages doesn't starve lower ones.
+  priority_is_released = 0;
+  num_priority_recd    = 0;
+  thready__send(NULL, kid);
+  thready__send_priority((void *)(intptr_t)1, kid, thready__priority_low);
+  for (int i = 0; i < num_urgent_msgs; ++i) {
+    thready__send_priority((void *)(intptr_t)4, kid, thready__priority_urgent);
+  }
+  priority_run(num_urgent_msgs + 1);
+  test_that(priority_order[num_urgent_msgs] == thready__priority_urgent);
+
+  test_that(thready__send_priority(NULL, kid, thready__num_priorities) ==
+            thready__error);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Attributes test
+
+static thready__Id attrs_main_id;
+static int attrs_is_done = 0;
+static int attrs_cpu     = 0;  // The cpu the kid is pinned to.
+
+void attrs_kid_get_msg(void *msg, thready__Id from) {
+#ifdef __linux__
+  char name[16];
+  pthread_getname_np(pthread_self(), name, sizeof(name));
+  test_str_eq(name, "attrs_kid");
+  test_that(sched_getcpu() == attrs_cpu);
+#endif
+  // A small stack is still plenty for modest receivers.
+  char buffer[4096];
+  memset(buffer, 1, sizeof(buffer));
+  test_that(buffer[sizeof(buffer) - 1] == 1);
+
+  thready__send(&attrs_is_done, attrs_main_id);
+}
+
+void attrs_main_get_msg(void *msg, thready__Id from) {
+  if (msg == &attrs_is_done) attrs_is_done = 1;
+}
+
+int attrs_test() {
+  attrs_main_id = thready__my_id();
+
+#ifdef __linux__
+  // We pin to the first cpu we may run on, which isn't always cpu 0.
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    while (attrs_cpu < CPU_SETSIZE - 1 && !CPU_ISSET(attrs_cpu, &allowed)) {
+      attrs_cpu++;
+    }
+  }
+#endif
+  int cpus[] = { attrs_cpu };
+  thready__Attrs attrs = {
+    .stack_size = 64 * 1024,
+    .name       = "attrs_kid",
+    .cpus       = cpus,
+    .num_cpus   = 1
+  };
+  thready__Id kid = thready__create_with_attrs(attrs_kid_get_msg, &attrs);
+  test_that(kid != thready__error);
+  thready__send(NULL, kid);
+  while (!attrs_is_done) thready__runloop(attrs_main_get_msg, thready__blocking);
+
+  // Bad attributes are caught before a thread is made.
+  thready__Attrs bad_capacity = { .capacity = -1 };
+  test_that(thready__create_with_attrs(attrs_kid_get_msg, &bad_capacity) ==
+            thready__error);
+  thready__Attrs bad_policy = { .sched_policy = 99 };
+  test_that(thready__create_with_attrs(attrs_kid_get_msg, &bad_policy) ==
+            thready__error);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Stats test
+
+#define num_stats_msgs 10
+
+static int num_stats_replies = 0;
+
+void stats_kid_get_msg(void *msg, thready__Id from) {
+  thready__send(msg, from);
+}
+
+void stats_main_get_msg(void *msg, thready__Id from) {
+  if (msg == &num_stats_replies) num_stats_replies++;
+}
+
+// Returns 1 if the inbox depth of `id` is 0 every time we look over the next
+// 20 ms.
+static int depth_stays_0(thready__Id id) {
+  for (int i = 0; i < 20; ++i) {
+    thready__Stats stats;
+    if (thready__thread_stats(id, &stats) != thready__success) return 0;
+    if (stats.inbox_depth != 0) return 0;
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+    nanosleep(&delay, NULL);
+  }
+  return 1;
+}
+
+int stats_test() {
+  thready__Attrs attrs = { .name = "stats_kid" };
+  thready__Id kid = thready__create_with_attrs(stats_kid_get_msg, &attrs);
+
+  thready__Stats before;
+  test_that(thready__thread_stats(thready__my_id(), &before) == thready__success);
+
+  for (int i = 0; i < num_stats_msgs; ++i) {
+    thready__send(&num_stats_replies, kid);
+  }
+  while (num_stats_replies < num_stats_msgs) {
+    thready__runloop(stats_main_get_msg, thready__blocking);
+  }
+
+  thready__Stats after;
+  thready__thread_stats(thready__my_id(), &after);
+  test_that(after.num_sent     - before.num_sent     == num_stats_msgs);
+  test_that(after.num_received - before.num_received >= num_stats_msgs);
+
+  // The kid should show up in a snapshot of all threads.
+  int num_threads = thready__stats(NULL, 0);
+  test_that(num_threads >= 2);
+  thready__Stats *all = malloc(num_threads * sizeof(thready__Stats));
+  num_threads = thready__stats(all, num_threads);
+  int num_found = 0;
+  for (int i = 0; i < num_threads; ++i) {
+    if (all[i].id != kid) continue;
+    num_found++;
+    test_str_eq(all[i].name, "stats_kid");
+    test_that(all[i].num_sent     == num_stats_msgs);
+    test_that(all[i].num_received == num_stats_msgs);
+    test_that(all[i].max_inbox_depth >= 1);
+  }
+  test_that(num_found == 1);
+  free(all);
+
+  // An actor's depth is back to 0 once it has handled its messages.
+  thready__Id actor = thready__spawn(stats_kid_get_msg);
+  num_stats_replies = 0;
+  for (int i = 0; i < num_stats_msgs; ++i) {
+    thready__send(&num_stats_replies, actor);
+  }
+  while (num_stats_replies < num_stats_msgs) {
+    thready__runloop(stats_main_get_msg, thready__blocking);
+  }
+  test_that(depth_stays_0(actor));
+  thready__Stats actor_stats;
+  thready__thread_stats(actor, &actor_stats);
+  test_that(actor_stats.num_received == num_stats_msgs);
+  test_that(actor_stats.max_inbox_depth >= 1);
+  test_that(actor_stats.max_inbox_depth <= num_stats_msgs);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Trace test
+
+#define num_trace_msgs 5
+#define trace_path "thready_trace_test.json"
+
+static int num_trace_replies = 0;
+
+void trace_main_get_msg(void *msg, thready__Id from) {
+  if (msg == &num_trace_replies) num_trace_replies++;
+}
+
+int trace_test() {
+  // Names are escaped in the json.
+  thready__Attrs attrs = { .name = "trace\"kid\\" };
+  thready__Id kid = thready__create_with_attrs(stats_kid_get_msg, &attrs);
+
+  test_that(thready__trace_start(-1) == thready__error);
+  test_that(thready__trace_start(0)  == thready__success);
+  for (int i = 0; i < num_trace_msgs; ++i) {
+    thready__send(&num_trace_replies, kid);
+  }
+  while (num_trace_replies < num_trace_msgs) {
+    thready__runloop(trace_main_get_msg, thready__blocking);
+  }
+  thready__trace_stop();
+
+  test_that(thready__trace_write(trace_path) == thready__success);
+
+  FILE *file = fopen(trace_path, "r");
+  test_that(file != NULL);
+  static char json[1 << 20];
+  size_t len = fread(json, 1, sizeof(json) - 1, file);
+  json[len] = '\0';
+  fclose(file);
+  remove(trace_path);
+
+  test_that(strncmp(json, "{\"traceEvents\":[", 16) == 0);
+  test_that(strstr(json, "trace\\\"kid\\\\\"") != NULL);
+  test_that(strstr(json, "\"name\":\"send\"")    != NULL);
+  test_that(strstr(json, "\"name\":\"enqueue\"") != NULL);
+  test_that(strstr(json, "\"name\":\"dequeue\"") != NULL);
+  test_that(strstr(json, "\"ph\":\"B\"")         != NULL);
+  test_that(strstr(json, "\"ph\":\"E\"")         != NULL);
+
+  // Events from before a new session are left out.
+  thready__trace_start(0);
+  thready__trace_stop();
+  test_that(thready__trace_write(trace_path) == thready__success);
+  file = fopen(trace_path, "r");
+  len = fread(json, 1, sizeof(json) - 1, file);
+  json[len] = '\0';
+  fclose(file);
+  remove(trace_path);
+  test_that(strstr(json, "trace\\\"kid") == NULL);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Call test
+
+// The server replies to n with n + 1. It holds a reply to call_hold until
+// call_is_released is set, and doesn't reply to call_no_reply.
+static int call_hold, call_no_reply;
+static int call_is_released = 0;
+
+static thready__Id call_main_id;
+static intptr_t    call_then_reply = 0;
+static int         call_then_is_on_caller = 0;
+static int         num_call_extra_replies = 0;
+
+void call_server_get_msg(void *msg, thready__Id from) {
+  if (msg == &call_no_reply) return;
+  if (msg == &call_hold) {
+    while (!__atomic_load_n(&call_is_released, __ATOMIC_SEQ_CST)) {
+      struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+      nanosleep(&delay, NULL);
+    }
+  }
+  thready__reply((void *)((intptr_t)msg + 1));
+  // A call gets only one reply.
+  if (thready__reply(NULL) != thready__error) num_call_extra_replies++;
+}
+
+// This runs on the caller's thread, from its runloop.
+void call_then(void *reply, thready__Id from) {
+  call_then_reply        = (intptr_t)reply;
+  call_then_is_on_caller = (thready__my_id() == call_main_id);
+}
+
+void call_main_get_msg(void *msg, thready__Id from) {}
+
+int call_test() {
+  call_main_id = thready__my_id();
+  thready__Id server = thready__create(call_server_get_msg);
+
+  // Replying only works from within a call.
+  test_that(thready__reply(NULL) == thready__error);
+
+  void *reply = NULL;
+  thready__Future *future = thready__call((void *)41, server);
+  test_that(future != NULL);
+  test_that(thready__future_wait(future, -1, &reply) == thready__success);
+  test_that((intptr_t)reply == 42);
+
+  // A wait can time out and be tried again.
+  future = thready__call(&call_hold, server);
+  test_that(thready__future_wait(future, 0,      &reply) == thready__error);
+  test_that(thready__future_wait(future, 5 * ms, &reply) == thready__error);
+  __atomic_store_n(&call_is_released, 1, __ATOMIC_SEQ_CST);
+  test_that(thready__future_wait(future, -1, &reply) == thready__success);
+  test_that(reply == (char *)&call_hold + 1);
+
+  // A receiver that doesn't reply gives a NULL reply.
+  reply  = &reply;
+  future = thready__call(&call_no_reply, server);
+  test_that(thready__future_wait(future, -1, &reply) == thready__success);
+  test_that(reply == NULL);
+
+  // Callbacks work with actors too.
+  thready__Id actor = thready__spawn(call_server_get_msg);
+  future = thready__call((void *)99, actor);
+  test_that(thready__future_then(future, call_then) == thready__success);
+  while (call_then_reply == 0) {
+    thready__runloop(call_main_get_msg, thready__blocking);
+  }
+  test_that(call_then_reply == 100);
+  test_that(call_then_is_on_caller);
+
+  // A cancelled call is still delivered.
+  thready__future_cancel(thready__call((void *)1, server));
+  future = thready__call((void *)2, server);
+  test_that(thready__future_wait(future, -1, &reply) == thready__success);
+  test_that((intptr_t)reply == 3);
+  test_that(num_call_extra_replies == 0);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Topic test
+
+#define num_topic_subscribers 3
+
+static thready__Id topic_main_id;
+static int         num_topic_replies;
+
+// Subscribers send back each payload they get, after checking its contents.
+// The main thread keeps its own reference, so the pointer stays valid.
+void topic_subscriber_get_msg(void *msg, thready__Id from) {
+  void *reply = (*(int *)msg == 1234) ? msg : NULL;
+  thready__shared_release(msg);
+  thready__send(reply, topic_main_id);
+}
+
+static void *topic_payload;
+
+void topic_main_get_msg(void *msg, thready__Id from) {
+  if (msg == topic_payload) num_topic_replies++;
+}
+
+static void wait_for_topic_replies(int num_replies) {
+  while (num_topic_replies < num_replies) {
+    thready__runloop(topic_main_get_msg, thready__blocking);
+  }
+  num_topic_replies = 0;
+}
+
+int topic_test() {
+  topic_main_id = thready__my_id();
+  thready__Topic *topic = thready__topic_new();
+  test_that(topic != NULL);
+
+  thready__Id ids[num_topic_subscribers];
+  for (int i = 0; i < num_topic_subscribers; ++i) {
+    // Actors and OS threads can subscribe alike.
+    ids[i] = (i % 2) ? thready__spawn(topic_subscriber_get_msg) :
+                       thready__create(topic_subscriber_get_msg);
+    test_that(thready__topic_subscribe(topic, ids[i]) == thready__success);
+  }
+  test_that(thready__topic_subscribe(topic, ids[0]) == thready__error);
+
+  topic_payload = thready__shared_alloc(sizeof(int));
+  *(int *)topic_payload = 1234;
+  test_that(thready__topic_publish(topic, topic_payload) ==
+            num_topic_subscribers);
+  wait_for_topic_replies(num_topic_subscribers);
+
+  test_that(thready__topic_unsubscribe(topic, ids[1]) == thready__success);
+  test_that(thready__topic_unsubscribe(topic, ids[1]) == thready__error);
+  test_that(thready__topic_publish(topic, topic_payload) ==
+            num_topic_subscribers - 1);
+  wait_for_topic_replies(num_topic_subscribers - 1);
+
+  thready__shared_release(topic_payload);
+  thready__topic_delete(topic);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Stale id test
+
+// Sends to `id` until it's recognized as the id of an exited thread. Returns 0
+// if that takes too long.
+static int wait_until_stale(thready__Id id) {
+  for (int i = 0; i < 1000; ++i) {
+    if (thready__send(NULL, id) == thready__error) return 1;
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+    nanosleep(&delay, NULL);
+  }
+  return 0;
+}
+
+static int num_exit_race_runs;
+
+void exit_race_get_msg(void *msg, thready__Id from) {
+  __atomic_add_fetch(&num_exit_race_runs, 1, __ATOMIC_SEQ_CST);
+  thready__exit();
+}
+
+int stale_id_test() {
+  thready__Stats stats;
+  thready__Id ids[] = {
+    thready__create(get_msg_and_exit),
+    thready__spawn(actor_get_msg_and_exit)
+  };
+
+  for (int i = 0; i < 2; ++i) {
+    test_that(thready__send(NULL, ids[i]) == thready__success);
+    thready__runloop(do_nothing_receiver, thready__blocking);
+
+    test_that(wait_until_stale(ids[i]));
+    test_that(thready__try_send(NULL, ids[i]) == thready__error);
+    test_that(thready__thread_stats(ids[i], &stats) == thready__error);
+  }
+
+  // New threads never get an old id.
+  thready__Id new_id = thready__spawn(do_nothing_receiver);
+  test_that(new_id != ids[0] && new_id != ids[1]);
+  test_that(thready__send(NULL, new_id) == thready__success);
+
+  // Ids that were never handed out are rejected too.
+  test_that(thready__send(NULL, (thready__Id)(intptr_t)0x5) == thready__error);
+
+  // Sends that race with an exit are either refused or freed with the inbox.
+  // The actor never runs after its exit, and calls to it get a NULL reply.
+  num_exit_race_runs = 0;
+  for (int i = 0; i < 100; ++i) {
+    thready__Id id = thready__spawn(exit_race_get_msg);
+    for (int j = 0; j < 10; ++j) thready__send(NULL, id);
+    thready__Future *future = thready__call(NULL, id);
+    void *reply = &reply;
+    if (future) {
+      test_that(thready__future_wait(future, -1, &reply) == thready__success);
+      test_that(reply == NULL);
+    }
+    test_that(wait_until_stale(id));
+  }
+  test_that(num_exit_race_runs == 100);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Inbox fd test
+
+static int num_inbox_fd_msgs = 0;
+
+void inbox_fd_main_get_msg(void *msg, thready__Id from) {
+  num_inbox_fd_msgs++;
+}
+
+#ifdef __linux__
+
+// Returns 1 if `fd` becomes readable within timeout_ms milliseconds.
+static int is_readable(int fd, int timeout_ms) {
+  struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+  return poll(&pollfd, 1, timeout_ms) == 1;
+}
+
+#endif
+
+int inbox_fd_test() {
+  // Actors don't own a thread to wait on an fd.
+  thready__Id actor = thready__spawn(do_nothing_receiver);
+  test_that(actor != thready__error);
+
+#ifdef __linux__
+  // Let earlier tests' stray messages arrive, and drop them.
+  thready__runloop_until(do_nothing_receiver, thready__now_ns() + 10000000);
+
+  int fd = thready__inbox_fd();
+  test_that(fd >= 0);
+  test_that(thready__inbox_fd() == fd);
+  test_that(!is_readable(fd, 0));
+
+  // A reply from another thread makes the fd readable, and receiving it makes
+  // the fd unreadable again.
+  thready__Id kid = thready__create(stats_kid_get_msg);
+  thready__send((void *)(intptr_t)1, kid);
+  test_that(is_readable(fd, 5000));
+  thready__runloop(inbox_fd_main_get_msg, thready__nonblocking);
+  test_that(num_inbox_fd_msgs == 1);
+  test_that(!is_readable(fd, 0));
+
+  // Messages that are still waiting keep the fd readable.
+  thready__Id me = thready__my_id();
+  for (int i = 0; i < 3; ++i) thready__send(NULL, me);
+  test_that(is_readable(fd, 0));
+  thready__runloop_budget(inbox_fd_main_get_msg, 1, 0);
+  test_that(is_readable(fd, 0));
+  thready__runloop_budget(inbox_fd_main_get_msg, 0, 0);
+  test_that(num_inbox_fd_msgs == 4);
+  test_that(!is_readable(fd, 0));
+#endif
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Reactor test
+
+#ifdef __linux__
+
+static thready__Id reactor_main_id;
+static intptr_t    reactor_result;
+static int         num_reactor_results = 0;
+
+// Replies with the number of bytes read, 100 for a writable fd, or -1 for a
+// hangup with nothing to read.
+void reactor_actor_get_msg(void *msg, thready__Id from) {
+  test_that(from == thready__reactor);
+  thready__FdEvent *event = (thready__FdEvent *)msg;
+  intptr_t result = -1;
+  if (event->events & thready__fd_read) {
+    char buffer[64];
+    result = read(event->fd, buffer, sizeof(buffer));
+  } else if (event->events & thready__fd_write) {
+    result = 100;
+  }
+  thready__send((void *)result, reactor_main_id);
+}
+
+void reactor_main_get_msg(void *msg, thready__Id from) {
+  reactor_result = (intptr_t)msg;
+  num_reactor_results++;
+}
+
+// Returns the next result from the actor.
+static intptr_t next_reactor_result() {
+  int num_results = num_reactor_results;
+  while (num_reactor_results == num_results) {
+    thready__runloop(reactor_main_get_msg, thready__blocking);
+  }
+  return reactor_result;
+}
+
+// Returns 1 if no result arrives within 20 ms.
+static int has_no_reactor_result() {
+  int num_results = num_reactor_results;
+  thready__runloop_until(reactor_main_get_msg, thready__now_ns() + 20000000);
+  return num_reactor_results == num_results;
+}
+
+#endif
+
+int reactor_test() {
+#ifdef __linux__
+  reactor_main_id = thready__my_id();
+  thready__Id actor = thready__spawn(reactor_actor_get_msg);
+
+  // A pipe becomes readable when written to.
+  int pipe_fds[2];
+  test_that(pipe(pipe_fds) == 0);
+  fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+  test_that(thready__watch_fd(pipe_fds[0], thready__fd_read, actor) ==
+            thready__success);
+  test_that(write(pipe_fds[1], "abc", 3) == 3);
+  test_that(next_reactor_result() == 3);
+
+  // Watches are one-shot, so more data waits until the fd is watched again.
+  test_that(write(pipe_fds[1], "de", 2) == 2);
+  test_that(has_no_reactor_result());
+  test_that(thready__watch_fd(pipe_fds[0], thready__fd_read, actor) ==
+            thready__success);
+  test_that(next_reactor_result() == 2);
+
+  // Closing the write end is a hangup.
+  close(pipe_fds[1]);
+  test_that(thready__watch_fd(pipe_fds[0], thready__fd_read, actor) ==
+            thready__success);
+  intptr_t result = next_reactor_result();
+  test_that(result == 0 || result == -1);
+  close(pipe_fds[0]);
+
+  // A unix socket is writable right away, and readable once its peer writes.
+  int socket_fds[2];
+  test_that(socketpair(AF_UNIX, SOCK_STREAM, 0, socket_fds) == 0);
+  test_that(thready__watch_fd(socket_fds[0], thready__fd_write, actor) ==
+            thready__success);
+  test_that(next_reactor_result() == 100);
+  test_that(thready__watch_fd(socket_fds[0], thready__fd_read, actor) ==
+            thready__success);
+  test_that(write(socket_fds[1], "hello", 5) == 5);
+  test_that(next_reactor_result() == 5);
+
+  // Nothing arrives for an unwatched fd.
+  test_that(thready__watch_fd(socket_fds[0], thready__fd_read, actor) ==
+            thready__success);
+  test_that(thready__unwatch_fd(socket_fds[0]) == thready__success);
+  test_that(thready__unwatch_fd(socket_fds[0]) == thready__error);
+  test_that(write(socket_fds[1], "x", 1) == 1);
+  test_that(has_no_reactor_result());
+  close(socket_fds[0]);
+  close(socket_fds[1]);
+
+  // Bad arguments.
+  test_that(thready__watch_fd(-1, thready__fd_read, actor) == thready__error);
+  test_that(thready__watch_fd(0, 0, actor) == thready__error);
+  test_that(thready__watch_fd(0, thready__fd_read, thready__error) ==
+            thready__error);
+#endif
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Coroutine test
+
+// Many more coroutines than workers, so that the test would deadlock if an
+// await blocked its worker.
+#define num_coroutines 64
+
+static thready__Id coroutine_server_id;
+static thready__Id coroutine_main_id;
+static int         num_server_calls = 0;
+static int         num_coroutine_results;
+static intptr_t    coroutine_sum;
+
+// The server doesn't reply to any call until all of them have arrived. Each
+// call waits in a nested runloop for the next, so the last one is replied to
+// first.
+void coroutine_server_get_msg(void *msg, thready__Id from) {
+  num_server_calls++;
+  while (num_server_calls < num_coroutines) {
+    thready__runloop(coroutine_server_get_msg, thready__blocking);
+  }
+  thready__reply((void *)((intptr_t)msg * 2));
+}
+
+void coroutine_get_msg(void *msg, thready__Id from) {
+  void *reply;
+  thready__Id my_id = thready__my_id();
+  thready__Future *future = thready__call(msg, coroutine_server_id);
+  test_that(thready__await_reply(future, &reply) == thready__success);
+  test_that((intptr_t)reply == (intptr_t)msg * 2);
+
+  // Receivers resume where they left off, possibly on another worker.
+  test_that(thready__my_id() == my_id);
+  thready__send(reply, coroutine_main_id);
+}
+
+void coroutine_get_msg_and_exit(void *msg, thready__Id from) {
+  void *reply;
+  thready__await_reply(thready__call(msg, coroutine_server_id), &reply);
+  thready__send(reply, coroutine_main_id);
+  thready__exit();
+  test_failed("We shouldn't get here since it's after thready__exit.\n");
+}
+
+void coroutine_main_get_msg(void *msg, thready__Id from) {
+  coroutine_sum += (intptr_t)msg;
+  num_coroutine_results++;
+}
+
+static void run_coroutines(thready__Receiver receiver, thready__Id *ids) {
+  num_server_calls      = 0;
+  num_coroutine_results = 0;
+  coroutine_sum         = 0;
+  for (int i = 0; i < num_coroutines; ++i) {
+    ids[i] = thready__spawn_coroutine(receiver);
+    test_that(ids[i] != thready__error);
+    thready__send((void *)(intptr_t)(i + 1), ids[i]);
+  }
+  while (num_coroutine_results < num_coroutines) {
+    thready__runloop(coroutine_main_get_msg, thready__blocking);
+  }
+  test_that(coroutine_sum == num_coroutines * (num_coroutines + 1));
+}
+
+int coroutine_test() {
+  coroutine_main_id   = thready__my_id();
+  coroutine_server_id = thready__create(coroutine_server_get_msg);
+  thready__Id ids[num_coroutines];
+
+  run_coroutines(coroutine_get_msg, ids);
+
+  // A second round reuses the stacks.
+  run_coroutines(coroutine_get_msg, ids);
+
+  // Coroutines can exit after they resume.
+  run_coroutines(coroutine_get_msg_and_exit, ids);
+  for (int i = 0; i < num_coroutines; ++i) {
+    test_that(wait_until_stale(ids[i]));
+  }
+
+  // Outside a coroutine, thready__await_reply just waits.
+  void *reply;
+  num_server_calls = num_coroutines - 1;
+  thready__Future *future = thready__call((void *)(intptr_t)21,
+                                          coroutine_server_id);
+  test_that(thready__await_reply(future, &reply) == thready__success);
+  test_that((intptr_t)reply == 42);
+  test_that(thready__await_reply(NULL, &reply) == thready__error);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Channel tests
+
+#define num_channel_msgs 10000
+
+static thready__Channel *channel;
+static thready__Id       channel_producer_id;
+static intptr_t          channel_sum;
+static int               num_channel_msgs_received;
+static int               channel_is_in_order;
+
+void channel_producer_get_msg(void *msg, thready__Id from) {
+  // We send one message at a time, and then the rest in groups.
+  for (intptr_t i = 1; i <= num_channel_msgs / 2; ++i) {
+    thready__channel_send(channel, (void *)i);
+  }
+  void *msgs[100];
+  for (intptr_t i = num_channel_msgs / 2 + 1; i <= num_channel_msgs;) {
+    for (int j = 0; j < 100; ++j) msgs[j] = (void *)i++;
+    thready__channel_send_many(channel, msgs, 100);
+  }
+}
+
+static int channel_consumer_may_exit;
+
+// This holds up its first message until it's told to exit.
+void channel_consumer_get_msg(void *msg, thready__Id from) {
+  while (!__atomic_load_n(&channel_consumer_may_exit, __ATOMIC_SEQ_CST)) {
+    struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+    nanosleep(&delay, NULL);
+  }
+  thready__exit();
+}
+
+void channel_main_get_msg(void *msg, thready__Id from) {
+  num_channel_msgs_received++;
+  if ((intptr_t)msg != num_channel_msgs_received) channel_is_in_order = 0;
+  if (from != channel_producer_id) channel_is_in_order = 0;
+  channel_sum += (intptr_t)msg;
+}
+
+int channel_test() {
+  test_that(thready__channel_new(0, thready__my_id()) == NULL);
+  test_that(thready__channel_new(8, thready__error) == NULL);
+
+  // A producer that's faster than its consumer waits for room.
+  channel = thready__channel_new(8, thready__my_id());
+  test_that(channel != NULL);
+  channel_producer_id = thready__create(channel_producer_get_msg);
+  channel_is_in_order = 1;
+  thready__send(NULL, channel_producer_id);
+  while (num_channel_msgs_received < num_channel_msgs) {
+    thready__runloop(channel_main_get_msg, thready__blocking);
+  }
+  test_that(channel_is_in_order);
+  test_that(channel_sum == (intptr_t)num_channel_msgs *
+                           (num_channel_msgs + 1) / 2);
+  thready__channel_delete(channel);
+
+  // A thread can send on a channel to itself, but not wait for room.
+  channel = thready__channel_new(3, thready__my_id());  // Rounded up to 4.
+  channel_producer_id       = thready__my_id();
+  num_channel_msgs_received = 0;
+  for (intptr_t i = 1; i <= 4; ++i) {
+    test_that(thready__channel_try_send(channel, (void *)i) ==
+              thready__success);
+  }
+  test_that(thready__channel_try_send(channel, (void *)5) == thready__full);
+  test_that(thready__channel_send(channel, (void *)5) == thready__full);
+  thready__runloop(channel_main_get_msg, thready__nonblocking);
+  test_that(num_channel_msgs_received == 4);
+  test_that(channel_is_in_order);
+
+  // The channel outlives its creator's reference until the notice is done.
+  test_that(thready__channel_send(channel, (void *)5) == thready__success);
+  thready__channel_delete(channel);
+  thready__runloop(channel_main_get_msg, thready__nonblocking);
+  test_that(num_channel_msgs_received == 5);
+
+  // A producer waiting for room gives up when the consumer exits.
+  thready__Id consumer = thready__create(channel_consumer_get_msg);
+  channel = thready__channel_new(1, consumer);
+  channel_consumer_may_exit = 0;
+  thready__send(NULL, consumer);
+  test_that(thready__channel_send(channel, NULL) == thready__success);
+  __atomic_store_n(&channel_consumer_may_exit, 1, __ATOMIC_SEQ_CST);
+  test_that(thready__channel_send(channel, NULL) == thready__error);
+  thready__channel_delete(channel);
+
+  return test_success;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Pipeline tests
+
+#define num_pipeline_items 10000
+
+static intptr_t pipeline_sum;
+static int      num_pipeline_results;
+static int      num_pipeline_ends;
+static int      pipeline_is_done;
+
+void pipeline_square(void *item, thready__Id from) {
+  if (from == thready__end_of_stream) {
+    __atomic_add_fetch(&num_pipeline_ends, 1, __ATOMIC_SEQ_CST);
+    return;
+  }
+  intptr_t n = (intptr_t)item;
+  thready__pipeline_emit((void *)(n * n));
+}
+
+// This stage has a parallelism of 1, so it can keep a running total.
+void pipeline_add(void *item, thready__Id from) {
+  static intptr_t total = 0;
+  if (from == thready__end_of_stream) {
+    thready__pipeline_emit((void *)total);
+    total = 0;
+  } else {
+    total += (intptr_t)item;
+  }
+}
+
+void pipeline_main_get_msg(void *msg, thready__Id from) {
+  if (from == thready__end_of_stream) {
+    pipeline_is_done = 1;
+    return;
+  }
+  pipeline_sum += (intptr_t)msg;
+  num_pipeline_results++;
+}
+
+static void run_pipeline(thready__Pipeline *pipeline, int num_items) {
+  pipeline_sum         = 0;
+  num_pipeline_results = 0;
+  pipeline_is_done     = 0;
+  for (intptr_t i = 1; i <= num_items; ++i) {
+    test_that(thready__pipeline_push(pipeline, (void *)i) == thready__success);
+  }
+  test_that(thready__pipeline_close(pipeline) == thready__success);
+  while (!pipeline_is_done) {
+    thready__runloop(pipeline_main_get_msg, thready__blocking);
+  }
+}
+
+int pipeline_test() {
+  test_that(thready__pipeline_new(-1, 0, thready__my_id()) == NULL);
+  test_that(thready__pipeline_new(0, 0, thready__error) == NULL);
+
+  // Small batches and inboxes make the stages wait on each other.
+  thready__Pipeline *pipeline = thready__pipeline_new(8, 2, thready__my_id());
+  test_that(pipeline != NULL);
+  test_that(thready__pipeline_add_stage(pipeline, pipeline_square, 0) ==
+            thready__error);
+  test_that(thready__pipeline_add_stage(pipeline, pipeline_square, 3) ==
+            thready__success);
+  test_that(thready__pipeline_add_stage(pipeline, pipeline_add, 1) ==
+            thready__success);
+
+  // A pipeline can't be freed while its stages are running.
+  test_that(thready__pipeline_delete(pipeline) == thready__error);
+
+  num_pipeline_ends = 0;
+  run_pipeline(pipeline, num_pipeline_items);
+  test_that(num_pipeline_results == 1);
+  intptr_t n = num_pipeline_items;
+  test_that(pipeline_sum == n * (n + 1) * (2 * n + 1) / 6);
+  test_that(num_pipeline_ends == 3);
+
+  // A closed pipeline takes no more items or stages.
+  test_that(thready__pipeline_push(pipeline, NULL) == thready__error);
+  test_that(thready__pipeline_close(pipeline) == thready__error);
+  test_that(thready__pipeline_add_stage(pipeline, pipeline_add, 1) ==
+            thready__error);
+  test_that(thready__pipeline_delete(pipeline) == thready__success);
+
+  // Without stages, items go straight to `to`.
+  pipeline = thready__pipeline_new(0, 0, thready__my_id());
+  run_pipeline(pipeline, 100);
+  test_that(num_pipeline_results == 100);
+  test_that(pipeline_sum == 100 * 101 / 2);
+  test_that(thready__pipeline_delete(pipeline) == thready__success);
+
+  // Emitting only works from within a stage.
+  test_that(thready__pipeline_emit(NULL) == thready__error);
+
+  return test_success;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Main
 
@@ -258,7 +1727,12 @@ int main(int argc, char **argv) {
 
   start_all_tests(argv[0]);
   run_tests(
-    simple_test, exit_test, four_thread_test, scale_test, create_once_test
+    simple_test, exit_test, four_thread_test, scale_test, create_once_test,
+    backlog_test, bounded_test, send_many_test, spawn_test, actor_ring_test,
+    timer_test, runloop_test, msg_pool_test, send_copy_test, priority_test,
+    attrs_test, stats_test, trace_test, call_test, topic_test,
+    stale_id_test, inbox_fd_test, reactor_test, coroutine_test, channel_test,
+    pipeline_test
   );
   return end_all_tests();
 }
@@ -0,0 +1,235 @@
+// channel.c
+//
+// https://github.com/tylerneylon/thready
+//
+// Single-producer, single-consumer channels for thready__channel_new.
+//
+// A channel is a fixed-size ring of message pointers. The producer fills slots
+// and publishes its tail index; the consumer empties them and publishes its
+// head index. Each side writes only its own cache line, and keeps a cached copy
+// of the other side's index, so it only reads the other side's line when its
+// cached copy says the ring is full, or when it starts a drain. The consumer
+// publishes its head once per batch of messages rather than once per message.
+//
+// The consumer learns of new messages through its ordinary inbox: when the
+// producer finds the channel idle, it sends the consumer a notice, which is an
+// envelope from channel__notice whose msg is the channel. Dispatching the
+// notice drains the channel into the consumer's receiver. This works like the
+// 0 -> 1 rule of inbox_count: is_scheduled is set while a notice is pending or
+// being dispatched, and whoever sets it sends the notice. So a steady stream
+// of messages costs one notice per drain, not one per message.
+//
+// A drain only goes as far as the tail it sees at its start. If more messages
+// have arrived by the end, it sends a new notice behind the inbox's other
+// messages, so that a busy channel doesn't starve the inbox.
+//
+// Each pending notice owns a reference to the channel, as does its creator, so
+// that thready__channel_delete can be called at any time after the last send.
+//
+// A producer waiting for room wakes up now and then to check that the consumer
+// hasn't exited, since an exited consumer never makes room.
+//
+
+#include "internal.h"
+
+#include <stdlib.h>
+
+
+// Internal types.
+
+// The consumer publishes its head at least this often while draining, so that
+// a producer waiting for room doesn't wait for the whole drain.
+#define max_unpublished 64
+
+// How often a producer waiting for room checks that the consumer still exists.
+#define exit_check_ns 10000000  // 10ms
+
+struct thready__Channel {
+  // These are written by the producer.
+  unsigned      tail;          // Slots ever filled.
+  unsigned      cached_head;   // The producer's last look at head.
+  int           is_waiting;    // Set while the producer may be parked.
+  thready__Id   from;          // The producer, as the consumer sees it.
+  char          padding1[cache_line_size];
+
+  // These are written by the consumer.
+  unsigned      head;          // Slots ever emptied.
+  char          padding2[cache_line_size];
+
+  // These are written by both.
+  int           is_scheduled;  // Set while a notice is pending or running.
+  int           num_owners;    // The creator, plus each pending notice.
+  char          padding3[cache_line_size];
+
+  // These never change.
+  thready__Id   to;
+  unsigned      capacity;      // A power of 2.
+  void *        slots[];
+};
+
+
+// Internal functions.
+
+static void release(Channel *channel) {
+  if (atomic__add(&channel->num_owners, -1) == 1) free(channel);
+}
+
+// Sends the consumer a notice unless one is already pending or running.
+static thready__Id notify(Channel *channel) {
+  if (atomic__load(&channel->is_scheduled) ||
+      atomic__swap(&channel->is_scheduled, 1)) {
+    return thready__success;
+  }
+  atomic__add(&channel->num_owners, 1);
+  if (inbox__force_send(channel->to, channel, 0, channel__notice) ==
+      thready__error) {
+    // Failed sends queue nothing, so the notice's reference is still ours.
+    release(channel);
+    return thready__error;
+  }
+  return thready__success;
+}
+
+// Returns the number of free slots, which is 0 if the ring is full.
+static unsigned free_slots(Channel *channel) {
+  unsigned num_used = channel->tail - channel->cached_head;
+  if (num_used == channel->capacity) {
+    channel->cached_head = atomic__load_acq(&channel->head);
+    num_used = channel->tail - channel->cached_head;
+  }
+  return channel->capacity - num_used;
+}
+
+// Sleeps until the ring has a free slot. Returns thready__error if the
+// consumer exits first.
+static thready__Id wait_for_free_slot(Channel *channel) {
+  // The consumer checks is_waiting after it publishes head, and we check head
+  // after we set is_waiting, so at least one of us sees the other.
+  atomic__store(&channel->is_waiting, 1);
+  thready__Id result = thready__success;
+  unsigned head;
+  while (channel->tail - (head = atomic__load(&channel->head)) ==
+         channel->capacity) {
+    if (thread__of(channel->to) == NULL) {
+      result = thready__error;
+      break;
+    }
+#if has_futex
+    futex_wait_ns((int *)&channel->head, (int)head, exit_check_ns);
+#else
+    thread_yield();
+#endif
+  }
+  atomic__store(&channel->is_waiting, 0);
+  channel->cached_head = head;
+  return result;
+}
+
+static void publish_head(Channel *channel, unsigned head) {
+  atomic__store(&channel->head, head);
+  if (atomic__load(&channel->is_waiting)) {
+#if has_futex
+    futex_wake((int *)&channel->head);
+#endif
+  }
+}
+
+// This is the implementation behind the send functions. It fills as many slots
+// as it can at a time, and publishes each group with a single store.
+static thready__Id send_msgs(Channel *channel, void **msgs, int count,
+                             int blocking) {
+  Thread *from = thread__current();
+  if (channel == NULL || from == NULL || count < 0) return thready__error;
+  if (atomic__load_relaxed(&channel->from) != from->id) {
+    atomic__store_relaxed(&channel->from, from->id);
+  }
+
+  while (count > 0) {
+    unsigned num_free = free_slots(channel);
+    if (num_free == 0) {
+      // A consumer can't wait for itself to make room.
+      if (!blocking || channel->to == from->id) return thready__full;
+      if (wait_for_free_slot(channel) == thready__error) return thready__error;
+      continue;
+    }
+    unsigned num = (unsigned)count < num_free ? (unsigned)count : num_free;
+    unsigned tail = channel->tail;
+    for (unsigned i = 0; i < num; ++i) {
+      channel->slots[(tail + i) & (channel->capacity - 1)] = msgs[i];
+    }
+    atomic__store(&channel->tail, tail + num);
+    if (notify(channel) == thready__error) return thready__error;
+    msgs  += num;
+    count -= num;
+  }
+
+  return thready__success;
+}
+
+
+// Functions shared with other files.
+
+int channel__drain(Channel *channel, thready__Receiver receiver) {
+  unsigned start = channel->head;
+  unsigned head  = start;
+  unsigned tail  = atomic__load_acq(&channel->tail);
+  thready__Id from = atomic__load_relaxed(&channel->from);
+
+  for (unsigned num_unpublished = 0; head != tail;) {
+    void *msg = channel->slots[head & (channel->capacity - 1)];
+    head++;
+    if (++num_unpublished == max_unpublished) {
+      publish_head(channel, head);
+      num_unpublished = 0;
+    }
+    receiver(msg, from);
+  }
+  publish_head(channel, head);
+
+  // Producers that filled slots after our look at tail saw is_scheduled set,
+  // and left the notice to us.
+  atomic__store(&channel->is_scheduled, 0);
+  if (atomic__load(&channel->tail) != head) notify(channel);
+
+  release(channel);  // This notice's reference.
+  return (int)(tail - start);
+}
+
+void channel__release(Channel *channel) {
+  release(channel);
+}
+
+
+// Public functions.
+
+thready__Channel *thready__channel_new(int capacity, thready__Id to) {
+  if (capacity < 1 || capacity > (1 << 30) || thread__of(to) == NULL) {
+    return NULL;
+  }
+  unsigned size = 1;
+  while (size < (unsigned)capacity) size *= 2;
+
+  Channel *channel = calloc(1, sizeof(Channel) + size * sizeof(void *));
+  if (channel == NULL) return NULL;
+  channel->num_owners = 1;
+  channel->to         = to;
+  channel->capacity   = size;
+  return channel;
+}
+
+void thready__channel_delete(thready__Channel *channel) {
+  if (channel) release(channel);
+}
+
+thready__Id thready__channel_send(thready__Channel *channel, void *msg) {
+  return send_msgs(channel, &msg, 1, 1);  // 1 --> blocking
+}
+
+thready__Id thready__channel_try_send(thready__Channel *channel, void *msg) {
+  return send_msgs(channel, &msg, 1, 0);  // 0 --> nonblocking
+}
+
+thready__Id thready__channel_send_many(thready__Channel *channel, void **msgs,
+                                       int count) {
+  return send_msgs(channel, msgs, count, 1);  // 1 --> blocking
+}
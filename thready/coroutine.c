@@ -0,0 +1,195 @@
+// coroutine.c
+//
+// https://github.com/tylerneylon/thready
+//
+// Coroutine actors, from thready__spawn_coroutine, whose receivers can wait
+// for a reply with thready__await_reply without blocking their worker.
+//
+// A coroutine actor dispatches each batch of messages on a stack of its own,
+// switched to with ucontext. When a receiver awaits a reply that hasn't
+// arrived, the coroutine switches back to the worker, which goes on to run
+// other actors. The batch isn't retired, so the actor's inbox_count stays
+// nonzero and no sender makes it ready; the reply does that instead, through
+// the future, and whichever worker picks the actor up switches back into the
+// coroutine. Messages that arrive in the meantime wait in the inbox, so a
+// coroutine actor still receives its messages one at a time, in order.
+//
+// The worker arms the future only after the coroutine has switched out, so a
+// quick reply can't resume the coroutine on another worker while it's still
+// running on this one.
+//
+// Stacks are only needed while a batch is being dispatched, so they're taken
+// from a shared pool at the start of a batch and given back at its end. Each
+// stack has a guard page below it, so an overflow crashes instead of
+// corrupting memory.
+//
+// A coroutine may resume on a different OS thread than the one it suspended
+// on. Code right after a switch avoids thread-local variables, whose addresses
+// the compiler may have computed before the switch.
+//
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE 600  // For ucontext.
+#endif
+
+#include "internal.h"
+
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <ucontext.h>
+#endif
+
+
+#ifndef _WIN32
+
+// Internal types.
+
+#define stack_size       (256 * 1024)
+#define max_free_stacks  64
+
+struct Coroutine {
+  ucontext_t          context;         // The coroutine's, while switched out.
+  ucontext_t          worker_context;  // The worker's, while switched in.
+  int                 status;          // A coroutine__* result.
+  Future *            awaited;         // Set while suspended.
+  char *              stack;           // Starts with the guard page.
+  struct Coroutine *  next_free;
+};
+
+
+// Internal data.
+
+// Coroutines that aren't running a batch, with their stacks.
+static Coroutine *      free_coroutines = NULL;
+static int              num_free        = 0;
+static pthread_mutex_t  free_mutex      = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Internal functions.
+
+static size_t page_size() {
+  long size = sysconf(_SC_PAGESIZE);
+  return size > 0 ? (size_t)size : 4096;
+}
+
+// Returns NULL if we're out of memory.
+static Coroutine *alloc_coroutine() {
+  pthread_mutex_lock(&free_mutex);
+  Coroutine *coroutine = free_coroutines;
+  if (coroutine) {
+    free_coroutines = coroutine->next_free;
+    num_free--;
+  }
+  pthread_mutex_unlock(&free_mutex);
+  if (coroutine) return coroutine;
+
+  coroutine = malloc(sizeof(Coroutine));
+  if (coroutine == NULL) return NULL;
+  coroutine->stack = mmap(NULL, page_size() + stack_size,
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON,
+                          -1, 0);  // -1, 0 --> no file
+  if (coroutine->stack == MAP_FAILED) {
+    free(coroutine);
+    return NULL;
+  }
+  mprotect(coroutine->stack, page_size(), PROT_NONE);
+  return coroutine;
+}
+
+static void free_coroutine(Coroutine *coroutine) {
+  pthread_mutex_lock(&free_mutex);
+  if (num_free < max_free_stacks) {
+    coroutine->next_free = free_coroutines;
+    free_coroutines      = coroutine;
+    num_free++;
+    coroutine = NULL;
+  }
+  pthread_mutex_unlock(&free_mutex);
+  if (coroutine == NULL) return;
+
+  munmap(coroutine->stack, page_size() + stack_size);
+  free(coroutine);
+}
+
+// Each batch starts here, on the coroutine's stack.
+static void coroutine_main() {
+  Thread *actor = thread__current();
+  thread__dispatch(actor, actor->receiver);
+
+  // We may be on a different OS thread now, so we use `actor`, and not
+  // thread__current, from here on.
+  actor->coroutine->status = coroutine__done;
+  setcontext(&actor->coroutine->worker_context);
+}
+
+// Switches back to the worker until `future` has its reply.
+static void suspend(Thread *actor, Future *future) {
+  Coroutine *coroutine = actor->coroutine;
+  coroutine->awaited   = future;
+  coroutine->status    = coroutine__suspended;
+  swapcontext(&coroutine->context, &coroutine->worker_context);
+}
+
+
+// Functions shared with other files.
+
+int coroutine__run(Thread *actor) {
+  Coroutine *coroutine = actor->coroutine;
+  if (coroutine == NULL) {
+    coroutine = alloc_coroutine();
+    if (coroutine == NULL) return coroutine__no_stack;
+    getcontext(&coroutine->context);
+    coroutine->context.uc_stack.ss_sp   = coroutine->stack + page_size();
+    coroutine->context.uc_stack.ss_size = stack_size;
+    coroutine->context.uc_link          = NULL;
+    makecontext(&coroutine->context, coroutine_main, 0);
+    actor->coroutine = coroutine;
+  }
+
+  // If the reply came before we could arm the future, we go straight back.
+  do {
+    swapcontext(&coroutine->worker_context, &coroutine->context);
+  } while (coroutine->status == coroutine__suspended &&
+           !future__await(coroutine->awaited, actor));
+
+  int status = coroutine->status;
+  if (status != coroutine__suspended) {
+    actor->coroutine = NULL;
+    free_coroutine(coroutine);
+  }
+  return status;
+}
+
+void coroutine__exit(Thread *actor) {
+  actor->coroutine->status = coroutine__exited;
+  setcontext(&actor->coroutine->worker_context);
+}
+
+#else  // _WIN32
+
+// Without ucontext, coroutine actors run like other actors, and
+// thready__await_reply blocks.
+
+int coroutine__run(Thread *actor) {
+  return coroutine__no_stack;
+}
+
+void coroutine__exit(Thread *actor) {}
+
+#endif
+
+
+// Public functions.
+
+thready__Id thready__await_reply(thready__Future *future, void **reply) {
+  if (future == NULL) return thready__error;
+  Thread *thread = thread__current();
+#ifndef _WIN32
+  if (thread && thread->coroutine && !future__is_replied(future)) {
+    suspend(thread, future);
+  }
+#endif
+  return thready__future_wait(future, -1, reply);  // -1 --> no timeout
+}
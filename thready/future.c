@@ -0,0 +1,200 @@
+// future.c
+//
+// https://github.com/tylerneylon/thready
+//
+// Futures for request/reply messaging with thready__call.
+//
+// A call is an ordinary message whose envelope also points to a future. The
+// callee answers with thready__reply, which stores the reply in the future
+// instead of sending a message back, so the reply never passes through the
+// caller's inbox and never mixes with its other messages. If a receiver
+// returns without replying, or its thread exits first, the call is completed
+// with a NULL reply, so that no caller waits forever.
+//
+// A future has two owners: the caller, until it waits for the reply, sets a
+// callback, or cancels; and the callee, until it replies. Whichever lets go
+// last frees the future. The state word records the reply and the callback;
+// whoever sets the second of those arranges for the callback to run, so that
+// it runs exactly once. Callbacks always run on the caller's thread, like its
+// receiver: a reply that comes after the callback is set is sent to the caller
+// as a notice, which its runloop dispatches by running the callback. A
+// coroutine actor awaiting the reply sets the callback bit too, and is made
+// ready instead.
+//
+// Waiters park on the state word with a futex on linux. Elsewhere, they sleep
+// on a condition variable shared by all futures, which is simple and fine for
+// the occasional blocking wait.
+//
+
+#include "internal.h"
+
+
+// Internal types.
+
+// Bits of Future.state.
+#define is_replied    1
+#define has_callback  2
+
+// Used as the deadline of waits that have none.
+#define no_deadline INT64_MAX
+
+struct thready__Future {
+  int               state;
+  int               num_owners;
+  int               is_waiting;  // Set while the caller may be parked.
+  void *            reply;
+  thready__Id       from;        // The thread that replied.
+  thready__Receiver callback;
+  thready__Id       caller;      // Where the callback runs.
+  Thread *          waiter;      // A coroutine actor to resume, if any.
+};
+
+
+// Internal data.
+
+#if !has_futex
+static pthread_mutex_t  future_mutex  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   future_signal = PTHREAD_COND_INITIALIZER;
+#endif
+
+
+// Internal functions.
+
+static void release(Future *future) {
+  if (atomic__add(&future->num_owners, -1) == 1) thready__msg_free(future);
+}
+
+// Waits until the future is replied to, or until the deadline, in clock_ns
+// time, has passed.
+static void wait_for_reply(Future *future, int64_t deadline) {
+  atomic__store(&future->is_waiting, 1);
+#if has_futex
+  int state;
+  while (((state = atomic__load(&future->state)) & is_replied) == 0) {
+    if (deadline == no_deadline) {
+      futex_wait(&future->state, state);
+    } else {
+      int64_t timeout_ns = deadline - clock_ns();
+      if (timeout_ns <= 0) break;
+      futex_wait_ns(&future->state, state, timeout_ns);
+    }
+  }
+#else
+  pthread_mutex_lock(&future_mutex);
+  while ((atomic__load(&future->state) & is_replied) == 0) {
+    if (deadline == no_deadline) {
+      pthread_cond_wait(&future_signal, &future_mutex);
+    } else {
+      int64_t timeout_ns = deadline - clock_ns();
+      if (timeout_ns <= 0) break;
+      pthread_cond_wait_ns(&future_signal, &future_mutex, timeout_ns);
+    }
+  }
+  pthread_mutex_unlock(&future_mutex);
+#endif
+  atomic__store(&future->is_waiting, 0);
+}
+
+
+// Functions shared with other files.
+
+Future *future__new() {
+  Future *future = thready__msg_alloc(sizeof(Future));
+  if (future == NULL) return NULL;
+  future->state      = 0;
+  future->num_owners = 2;
+  future->is_waiting = 0;
+  future->reply      = NULL;
+  future->from       = NULL;
+  future->callback   = NULL;
+  future->caller     = NULL;
+  future->waiter     = NULL;
+  return future;
+}
+
+void future__complete(Future *future, void *reply, thready__Id from) {
+  future->reply = reply;
+  future->from  = from;
+  int state = atomic__or(&future->state, is_replied);
+
+  if (state & has_callback) {
+    if (future->waiter) {
+      // The coroutine keeps the caller's ownership, and releases it once it
+      // has the reply.
+      scheduler__make_ready(future->waiter);
+    } else if (inbox__force_send(future->caller, future, 0, future__notice) ==
+               thready__error) {
+      // The caller has exited. Otherwise, its ownership passes to the notice.
+      release(future);
+    }
+  } else if (atomic__load(&future->is_waiting)) {
+    // The waiter sets is_waiting before its last check of the state, and we
+    // just changed the state, so at least one of us sees the other.
+#if has_futex
+    futex_wake(&future->state);
+#else
+    pthread_mutex_lock(&future_mutex);
+    pthread_cond_broadcast(&future_signal);
+    pthread_mutex_unlock(&future_mutex);
+#endif
+  }
+  release(future);
+}
+
+int future__is_replied(Future *future) {
+  return (atomic__load(&future->state) & is_replied) != 0;
+}
+
+void future__run_callback(Future *future) {
+  future->callback(future->reply, future->from);
+  release(future);
+}
+
+void future__drop(Future *future) {
+  release(future);
+}
+
+int future__await(Future *future, Thread *actor) {
+  future->waiter = actor;
+  int state = atomic__or(&future->state, has_callback);
+  return (state & is_replied) == 0;
+}
+
+
+// Public functions.
+
+thready__Id thready__future_wait(thready__Future *future, int64_t timeout_ns,
+                                 void **reply) {
+  if (future == NULL) return thready__error;
+
+  if ((atomic__load(&future->state) & is_replied) == 0) {
+    if (timeout_ns == 0) return thready__error;
+    int64_t deadline = timeout_ns < 0 ? no_deadline : clock_ns() + timeout_ns;
+    wait_for_reply(future, deadline);
+    if ((atomic__load(&future->state) & is_replied) == 0) return thready__error;
+  }
+
+  if (reply) *reply = future->reply;
+  release(future);
+  return thready__success;
+}
+
+thready__Id thready__future_then(thready__Future *future,
+                                 thready__Receiver callback) {
+  Thread *caller = thread__current();
+  if (future == NULL || callback == NULL || caller == NULL) {
+    return thready__error;
+  }
+  future->callback = callback;
+  future->caller   = caller->id;
+  int state = atomic__or(&future->state, has_callback);
+  if (state & is_replied) {
+    callback(future->reply, future->from);
+    release(future);
+  }
+  return thready__success;
+}
+
+void thready__future_cancel(thready__Future *future) {
+  if (future) release(future);
+}
@@ -0,0 +1,246 @@
+// internal.h
+//
+// https://github.com/tylerneylon/thready
+//
+// Types and functions shared between thready's source files. These are not
+// part of the public interface.
+//
+
+#pragma once
+
+#include "thready.h"
+
+#include "platform.h"
+#include "pthreads_win.h"  // <pthread.h> or a wrapper for it based on OS.
+
+
+// Internal types.
+
+typedef struct thready__Future Future;  // Defined in future.c.
+typedef struct Coroutine Coroutine;      // Defined in coroutine.c.
+typedef struct thready__Channel Channel; // Defined in channel.c.
+
+// Envelopes from this sender tell the recipient that a channel, given as the
+// msg, has messages. Like thready__success, this is never a thread's id.
+#define channel__notice ((thready__Id) 0x4)
+
+// Envelopes from this sender hand a replied future, given as the msg, to the
+// caller that set its callback with thready__future_then.
+#define future__notice  ((thready__Id) 0x6)
+
+// Envelopes are the nodes of a thread's inbox queue.
+typedef struct Envelope {
+  struct Envelope *next;
+  void *           msg;
+  thready__Id      from;
+  Future *         future;  // Set for messages from thready__call until
+                            // they're replied to. A thready__send_copy
+                            // payload starts here instead, and msg points to
+                            // it; copies are never calls.
+} Envelope;
+
+// Each priority has its own lane in the inbox.
+#define num_lanes thready__num_priorities
+
+// Each inbox lane is an intrusive, lock-free multi-producer single-consumer
+// queue in the style of Dmitry Vyukov's design. Senders push onto a lane head
+// with a single atomic exchange. The owning thread takes every pending envelope
+// of a lane at once by swapping the lane's stub back in as the head, and then
+// dispatches that batch without touching shared state. inbox_count covers all
+// lanes. The mutex and condition variables are only used when the owner goes
+// to sleep on an empty inbox, when a sender goes to sleep on a full inbox, or
+// to wake either of them up.
+//
+// Threads live in slots that are reused, but never freed; see thready.c.
+typedef struct Thread {
+  // Senders check this against the id they were given. It changes when the
+  // thread exits, so that the old id becomes stale.
+  uintptr_t        generation;
+
+  // These are written by senders.
+  Envelope *       lane_heads[num_lanes];
+  int              inbox_count;  // Messages announced by senders, not taken.
+  int              is_waiting;   // Set while the owner may be parked.
+  int              has_event_fd; // Set once thready__inbox_fd is called.
+  int              num_blocked_senders;  // Senders sleeping on space_signal.
+  int              num_senders;  // Senders between enter_inbox and
+                                 // leave_inbox; see thready.c.
+  int              capacity;     // The most messages inbox_count can reach;
+                                 // 0 means unbounded. This is set at creation.
+
+  char             padding[cache_line_size];
+
+  // These are written by the owning thread.
+  Envelope         lane_stubs[num_lanes];  // Each lane's placeholder node, so
+                                           // that a lane is never empty.
+  Envelope *       batches[num_lanes];     // Taken envelopes per lane that are
+                                           // not yet dispatched.
+  int              num_batched;  // The number of envelopes in batches.
+  int              num_taken;    // Envelopes an actor has taken but not
+                                 // yet retired.
+  unsigned         num_dispatched;  // Counts dispatches, for fairness.
+  Envelope *       in_use;       // Envelopes whose receiver calls are running,
+                                 // innermost first.
+  int              spin_budget;  // Polls of an empty inbox before parking.
+
+  // Counters for thready__stats. Only the owner updates these, so they don't
+  // need atomic read-modify-writes; readers may see slightly stale values.
+  uint64_t         num_sent;
+  uint64_t         num_received;
+  int              max_inbox_depth;
+  int64_t          blocked_ns;    // Waiting for messages or for inbox room.
+  int64_t          handler_ns;    // Running receivers.
+
+  pthread_mutex_t  inbox_mutex;
+  pthread_cond_t   inbox_signal;  // Goes off when the inbox becomes nonempty.
+  int              event_fd;      // Also signaled then, if has_event_fd is
+                                  // set. This belongs to the slot, so it's
+                                  // created once and never closed.
+  pthread_cond_t   space_signal;  // Goes off when a full inbox has room.
+
+  thready__Receiver receiver;     // Used by thready__create and thready__spawn.
+  char             name[16];      // From thready__Attrs; empty if unnamed.
+  thready__Id      id;            // Made from the slot index and generation.
+  uintptr_t        index;         // The slot index.
+  int              is_live;       // Cleared when the thread exits; guarded
+                                  // by slots_mutex.
+
+  // These are used by actors from thready__spawn, which have no OS thread of
+  // their own. An actor is in the scheduler's ready queue, or being run by a
+  // worker, exactly when its inbox_count is nonzero.
+  int              is_actor;
+  struct Thread *  next_ready;    // The next actor in the ready queue, or the
+                                  // next free slot.
+
+  // These are used by actors from thready__spawn_coroutine.
+  int              is_coroutine;
+  Coroutine *      coroutine;     // Set while a batch is being dispatched on
+                                  // the coroutine's own stack.
+} Thread;
+
+
+// Functions from thready.c.
+
+// Returns the calling thread's Thread, registering it if needed.
+Thread *   thread__current     ();
+// Returns the Thread with the given id, or NULL if the id is stale or invalid.
+// This takes no locks. The Thread stays safe to read after its thread exits.
+Thread *   thread__of          (thready__Id id);
+// Workers use this to act on behalf of the actor they're running.
+void       thread__set_current (Thread *thread);
+// Frees a Thread's slot along with any envelopes still in its inbox. Its id
+// is stale from then on.
+void       thread__release     (Thread *thread);
+// Dispatches and frees each envelope in thread->batches, highest lane first.
+void       thread__dispatch    (Thread *thread, thready__Receiver receiver);
+
+// Moves every linked envelope from the inbox into thread->batches and returns
+// how many were moved; see thready.c for details.
+int        inbox__take_all     (Thread *thread);
+// Sends regardless of the inbox capacity, so this never blocks. This is for
+// internal threads, such as the timer thread. A nonzero copy_len works as in
+// thready__send_copy. Returns thready__error if `to` has exited.
+thready__Id inbox__force_send  (thready__Id to, void *msg, size_t copy_len,
+                                thready__Id from);
+// Subtracts `num` taken messages from inbox_count and wakes any senders
+// waiting for room. Returns the new inbox_count.
+int        inbox__retire       (Thread *thread, int num);
+
+
+// Functions from scheduler.c.
+
+// Starts the worker pool if it isn't running yet. Returns thready__error if no
+// worker could be started. Every actor is made after a successful call.
+thready__Id scheduler__start      ();
+// Queues an actor to be run by a worker. Senders call this when an actor's
+// inbox_count goes from 0 to 1.
+void        scheduler__make_ready (Thread *actor);
+// Ends the calling actor from within its receiver. This does not return.
+void        scheduler__exit_actor ();
+
+
+// Functions from pool.c.
+
+// Hands blocks this thread has freed back to their pools. Call this before a
+// thread sleeps, or returns from a runloop that may not be called again soon,
+// so those blocks can be reused meanwhile.
+void pool__flush_returns ();
+// Gives the calling thread's pool to the next new thread; for exiting threads.
+void pool__release       ();
+
+
+// Functions from future.c.
+
+// Returns a new future owned by both a caller and a callee, or NULL if there's
+// no memory for it.
+Future * future__new      ();
+// Gives the future its reply, and ends the callee's ownership.
+void     future__complete (Future *future, void *reply, thready__Id from);
+// Returns 1 if the future has its reply.
+int      future__is_replied(Future *future);
+// Arranges for the suspended coroutine actor to be made ready when the future
+// gets its reply. Returns 0, without arranging anything, if it already has it.
+int      future__await    (Future *future, Thread *actor);
+// Runs the callback of a future from a future__notice, and frees the future.
+void     future__run_callback(Future *future);
+// Frees the future from a future__notice without running its callback.
+void     future__drop     (Future *future);
+
+
+// Functions from coroutine.c.
+
+// Results of coroutine__run.
+enum {
+  coroutine__done,       // The batch has been dispatched.
+  coroutine__suspended,  // A receiver is awaiting a reply.
+  coroutine__exited,     // A receiver called thready__exit.
+  coroutine__no_stack    // Nothing was run, as there's no stack to be had.
+};
+
+// Dispatches, or resumes dispatching, a coroutine actor's batch on its own
+// stack. Workers call this.
+int  coroutine__run  (Thread *actor);
+// Ends the batch from within the coroutine, for thready__exit. This does not
+// return.
+void coroutine__exit (Thread *actor);
+
+
+// Functions from channel.c.
+
+// Passes each message waiting in the channel to the receiver, and then gives
+// up the notice's reference to the channel. Returns the number of messages.
+int  channel__drain   (Channel *channel, thready__Receiver receiver);
+// Gives up a notice's reference to the channel without draining it.
+void channel__release (Channel *channel);
+
+
+// Functions from trace.c.
+
+// Event types for trace__event.
+enum {
+  trace__send,           // A sender is about to send.
+  trace__enqueue,        // A sender has linked messages into an inbox.
+  trace__dequeue,        // An inbox's owner has taken messages from it.
+  trace__handler_begin,  // A receiver call is starting.
+  trace__handler_end     // A receiver call has returned.
+};
+
+// Set while tracing is on.
+extern int trace__is_on;
+
+// Records an event in the calling OS thread's trace ring. `id` is the thread
+// or actor the event happens to; `other` is the thread at the other end of the
+// message, if any. `name` is only used for trace__handler_begin.
+void trace__record  (int type, thready__Id id, thready__Id other, int count,
+                     const char *name);
+// Gives the calling thread's ring to the next new thread; for exiting threads.
+void trace__release ();
+
+// Trace points call this, so that they cost only a load and a branch while
+// tracing is off.
+#define trace__event(type, id, other, count, name)                    \
+  do {                                                                \
+    if (atomic__load_relaxed(&trace__is_on)) {                        \
+      trace__record(type, id, other, count, name);                    \
+    }                                                                 \
+  } while (0)
@@ -0,0 +1,328 @@
+// pipeline.c
+//
+// https://github.com/tylerneylon/thready
+//
+// Staged processing pipelines for thready__pipeline_new.
+//
+// Each stage runs on `parallelism` threads of its own, each with a bounded
+// inbox, so a slow stage holds up the stages before it instead of letting
+// their output pile up; that's the flow control between stages. Items travel
+// in batches: every sender of items, whether a stage's worker or the thread
+// calling thready__pipeline_push, fills a batch and sends it as one message,
+// so each handoff between stages costs one send per batch rather than one per
+// item. A worker sends its partial batch after each batch it receives, so
+// items don't wait on a stage that has gone quiet.
+//
+// A sender hands its batches to the workers of the next stage in turn, but
+// skips a worker whose inbox is full when another one has room. Items from a
+// single sender reach a single worker in order, so a pipeline whose stages
+// each have a parallelism of 1 keeps its items in order.
+//
+// End of stream flows through the same inboxes as the items. Closing the
+// pipeline sends an end marker to each first-stage worker, behind its batches.
+// A worker that has a marker from every sender of the previous stage passes
+// thready__end_of_stream to its receiver, sends its last batch, sends markers
+// on to the next stage, and exits. The last worker of the last stage to finish
+// tells `to`.
+//
+// Workers never touch the pipeline after their last send, so it can be freed
+// as soon as `to` hears the end of the stream. Each worker of the last stage
+// counts itself out of num_unfinished as it ends, after every worker before it
+// has made its last send, so thready__pipeline_delete refuses to free the
+// pipeline until that count is 0.
+//
+
+#include "internal.h"
+
+#include <stdlib.h>
+
+
+// Internal types.
+
+#define default_batch_size  64
+#define default_capacity    16   // In batches, per worker.
+
+// These are Batch.count values for markers that carry no items.
+#define end_marker  -1
+#define quit_marker -2  // Ends a worker that was never connected.
+
+typedef struct Stage  Stage;
+typedef struct Worker Worker;
+typedef struct thready__Pipeline Pipeline;
+
+typedef struct {
+  Worker *  worker;  // The recipient.
+  int       count;   // The number of items, or one of the *_marker values.
+  void *    items[];
+} Batch;
+
+// A sender of batches to the next stage, or to the pipeline's `to` when
+// to_stage is NULL.
+typedef struct {
+  Pipeline *  pipeline;
+  Stage *     to_stage;
+  Batch *     batch;        // The batch being filled, or NULL.
+  int         next_worker;  // Our turn-taking position in to_stage.
+} Emitter;
+
+struct Worker {
+  thready__Id  id;
+  Stage *      stage;
+  Emitter      out;
+  int          num_ends;  // End markers received so far.
+};
+
+struct Stage {
+  thready__Receiver  receiver;
+  int                parallelism;
+  int                num_senders;  // The number of emitters feeding us.
+  Worker *           workers;
+  Stage *            next;
+};
+
+struct thready__Pipeline {
+  thready__Id  to;
+  int          batch_size;
+  int          capacity;
+  Stage *      first_stage;
+  Stage *      last_stage;
+  Emitter      source;         // Used by thready__pipeline_push.
+  int          is_started;
+  int          is_closed;
+  int          num_unfinished; // The emitters feeding `to` that haven't ended.
+};
+
+
+// Internal data.
+
+// This is set while a worker's receiver runs, for thready__pipeline_emit.
+static thread_local Emitter *current_emitter = NULL;
+
+
+// Internal functions.
+
+static Batch *new_batch(Pipeline *pipeline) {
+  Batch *batch = thready__msg_alloc(sizeof(Batch) +
+                                    pipeline->batch_size * sizeof(void *));
+  if (batch) batch->count = 0;
+  return batch;
+}
+
+static void send_batch(Emitter *emitter, Batch *batch) {
+  Stage *stage = emitter->to_stage;
+  if (stage == NULL) {
+    thready__send_many(batch->items, batch->count, emitter->pipeline->to);
+    thready__msg_free(batch);
+    return;
+  }
+
+  int n = stage->parallelism;
+  for (int i = 0; i < n; ++i) {
+    int j = (emitter->next_worker + i) % n;
+    batch->worker = stage->workers + j;
+    if (thready__try_send(batch, batch->worker->id) == thready__success) {
+      emitter->next_worker = (j + 1) % n;
+      return;
+    }
+  }
+
+  // Every worker is full, so we wait on the next one in turn.
+  batch->worker = stage->workers + emitter->next_worker;
+  emitter->next_worker = (emitter->next_worker + 1) % n;
+  if (thready__send(batch, batch->worker->id) != thready__success) {
+    thready__msg_free(batch);
+  }
+}
+
+static void flush(Emitter *emitter) {
+  if (emitter->batch == NULL || emitter->batch->count == 0) return;
+  send_batch(emitter, emitter->batch);
+  emitter->batch = NULL;
+}
+
+static thready__Id emit(Emitter *emitter, void *item) {
+  if (emitter->batch == NULL) {
+    emitter->batch = new_batch(emitter->pipeline);
+    if (emitter->batch == NULL) return thready__error;
+  }
+  Batch *batch = emitter->batch;
+  batch->items[batch->count++] = item;
+  if (batch->count == emitter->pipeline->batch_size) flush(emitter);
+  return thready__success;
+}
+
+// Sends the emitter's last batch and then passes on the end of the stream.
+// After this, the pipeline may be freed at any time. Returns thready__error if
+// the end of the stream couldn't be sent everywhere.
+static thready__Id end_stream(Emitter *emitter) {
+  flush(emitter);
+
+  Stage *stage = emitter->to_stage;
+  if (stage == NULL) {
+    Pipeline *pipeline = emitter->pipeline;
+    thready__Id to     = pipeline->to;
+    if (atomic__add(&pipeline->num_unfinished, -1) == 1) {
+      return inbox__force_send(to, pipeline, 0, thready__end_of_stream);
+    }
+    return thready__success;
+  }
+
+  Worker *    workers = stage->workers;
+  int         n       = stage->parallelism;
+  thready__Id result  = thready__success;
+  for (int i = 0; i < n; ++i) {
+    Batch *marker = thready__msg_alloc(sizeof(Batch));
+    if (marker == NULL) {
+      result = thready__error;
+      continue;
+    }
+    marker->worker = workers + i;
+    marker->count  = end_marker;
+    if (thready__send(marker, workers[i].id) != thready__success) {
+      thready__msg_free(marker);
+      result = thready__error;
+    }
+  }
+  return result;
+}
+
+static void worker_get_msg(void *msg, thready__Id from) {
+  Batch * batch  = msg;
+  Worker *worker = batch->worker;
+  Stage * stage  = worker->stage;
+  int     count  = batch->count;
+
+  if (count == quit_marker) {
+    thready__msg_free(batch);
+    thready__exit();
+  }
+
+  current_emitter = &worker->out;
+  if (count == end_marker) {
+    thready__msg_free(batch);
+    if (++worker->num_ends < stage->num_senders) {
+      current_emitter = NULL;
+      return;
+    }
+    stage->receiver(NULL, thready__end_of_stream);
+    current_emitter = NULL;
+    end_stream(&worker->out);
+    thready__exit();
+  }
+
+  for (int i = 0; i < count; ++i) stage->receiver(batch->items[i], from);
+  thready__msg_free(batch);
+  current_emitter = NULL;
+  flush(&worker->out);
+}
+
+
+// Public functions.
+
+thready__Pipeline *thready__pipeline_new(int batch_size, int capacity,
+                                         thready__Id to) {
+  if (batch_size < 0 || capacity < 0 || thread__of(to) == NULL) return NULL;
+
+  Pipeline *pipeline = calloc(1, sizeof(Pipeline));
+  if (pipeline == NULL) return NULL;
+  pipeline->to              = to;
+  pipeline->batch_size      = batch_size ? batch_size : default_batch_size;
+  pipeline->capacity        = capacity   ? capacity   : default_capacity;
+  pipeline->source.pipeline = pipeline;
+  pipeline->num_unfinished  = 1;  // The source, until there's a stage.
+  return pipeline;
+}
+
+thready__Id thready__pipeline_delete(thready__Pipeline *pipeline) {
+  // Until the count reaches 0, some worker may still use the pipeline.
+  if (pipeline == NULL || atomic__load(&pipeline->num_unfinished)) {
+    return thready__error;
+  }
+
+  Stage *stage = pipeline->first_stage;
+  while (stage) {
+    Stage *next = stage->next;
+    free(stage->workers);
+    free(stage);
+    stage = next;
+  }
+  thready__msg_free(pipeline->source.batch);
+  free(pipeline);
+  return thready__success;
+}
+
+thready__Id thready__pipeline_add_stage(thready__Pipeline *pipeline,
+                                        thready__Receiver receiver,
+                                        int parallelism) {
+  if (pipeline == NULL || receiver == NULL || parallelism < 1 ||
+      pipeline->is_started) {
+    return thready__error;
+  }
+
+  Stage *stage = calloc(1, sizeof(Stage));
+  if (stage == NULL) return thready__error;
+  stage->workers = calloc(parallelism, sizeof(Worker));
+  if (stage->workers == NULL) {
+    free(stage);
+    return thready__error;
+  }
+  stage->receiver    = receiver;
+  stage->parallelism = parallelism;
+  stage->num_senders = pipeline->last_stage ?
+                       pipeline->last_stage->parallelism : 1;
+
+  thready__Attrs attrs = { .capacity = pipeline->capacity,
+                           .name     = "pipeline" };
+  for (int i = 0; i < parallelism; ++i) {
+    Worker *worker       = stage->workers + i;
+    worker->stage        = stage;
+    worker->out.pipeline = pipeline;
+    worker->id = thready__create_with_attrs(worker_get_msg, &attrs);
+    if (worker->id != thready__error) continue;
+
+    // We end the workers we've made so far.
+    for (int j = 0; j < i; ++j) {
+      Batch *marker = thready__msg_alloc(sizeof(Batch));
+      if (marker == NULL) continue;
+      marker->worker = stage->workers + j;
+      marker->count  = quit_marker;
+      thready__send(marker, stage->workers[j].id);
+    }
+    free(stage->workers);
+    free(stage);
+    return thready__error;
+  }
+
+  // The previous stage, or the source, now sends to the new stage.
+  if (pipeline->last_stage) {
+    Stage *last = pipeline->last_stage;
+    for (int i = 0; i < last->parallelism; ++i) {
+      last->workers[i].out.to_stage = stage;
+    }
+    last->next = stage;
+  } else {
+    pipeline->source.to_stage = stage;
+    pipeline->first_stage     = stage;
+  }
+  pipeline->last_stage     = stage;
+  pipeline->num_unfinished = parallelism;
+  return thready__success;
+}
+
+thready__Id thready__pipeline_push(thready__Pipeline *pipeline, void *item) {
+  if (pipeline == NULL || pipeline->is_closed) return thready__error;
+  pipeline->is_started = 1;
+  return emit(&pipeline->source, item);
+}
+
+thready__Id thready__pipeline_close(thready__Pipeline *pipeline) {
+  if (pipeline == NULL || pipeline->is_closed) return thready__error;
+  pipeline->is_started = 1;
+  pipeline->is_closed  = 1;
+  return end_stream(&pipeline->source);
+}
+
+thready__Id thready__pipeline_emit(void *item) {
+  if (current_emitter == NULL) return thready__error;
+  return emit(current_emitter, item);
+}
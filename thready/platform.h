@@ -0,0 +1,189 @@
+// platform.h
+//
+// https://github.com/tylerneylon/thready
+//
+// Low-level primitives used internally by thready: atomic operations,
+// thread-local storage, a monotonic clock, and cpu-friendly ways to wait on
+// another thread.
+//
+// The atomics and thread-local storage are built on gcc/clang extensions,
+// which are available on all of our platforms (including mingw on windows).
+//
+
+#pragma once
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Atomic operations.
+
+// These work on any int-sized or pointer-sized lvalue. Unless the name says
+// otherwise, operations are sequentially consistent.
+
+#define atomic__load(ptr)         __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define atomic__load_acq(ptr)     __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define atomic__load_relaxed(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+
+#define atomic__store(ptr, val)     __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+#define atomic__store_rel(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define atomic__store_relaxed(ptr, val) \
+    __atomic_store_n(ptr, val, __ATOMIC_RELAXED)
+
+// Returns the old value.
+#define atomic__swap(ptr, val) __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+
+// Returns the old value.
+#define atomic__add(ptr, val) __atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST)
+
+// Returns the old value.
+#define atomic__or(ptr, val) __atomic_fetch_or(ptr, val, __ATOMIC_SEQ_CST)
+
+// Memory fences.
+#define atomic__fence()     __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define atomic__fence_rel() __atomic_thread_fence(__ATOMIC_RELEASE)
+
+// Returns true on success; on failure, *expected_ptr is set to the current
+// value.
+#define atomic__cas(ptr, expected_ptr, val) \
+    __atomic_compare_exchange_n(ptr, expected_ptr, val, 0, \
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Thread-local storage.
+
+// Use this on static variables to give each thread its own copy.
+#define thread_local __thread
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Waiting.
+
+// Gives up the rest of this thread's time slice. This is used when we are
+// waiting on another thread to finish a few instructions of work, such as
+// linking in a message it has already announced.
+#ifdef _WIN32
+#define thread_yield() SwitchToThread()
+#else
+#define thread_yield() sched_yield()
+#endif
+
+// Tells the cpu we're in a spin-wait loop. This saves power and lets a sibling
+// hyperthread run.
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax()
+#endif
+
+// On linux, threads park directly on a futex word. futex_wait sleeps as long as
+// *addr == val, and may return early; futex_wake wakes one thread sleeping on
+// addr.
+#ifdef __linux__
+#define has_futex 1
+
+static inline void futex_wait(int *addr, int val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+// Like futex_wait, but gives up after timeout_ns nanoseconds.
+static inline void futex_wait_ns(int *addr, int val, int64_t timeout_ns) {
+  struct timespec ts = { .tv_sec  = timeout_ns / 1000000000,
+                         .tv_nsec = timeout_ns % 1000000000 };
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+static inline void futex_wake(int *addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#else
+#define has_futex 0
+#endif
+
+// On linux, a thread can also be woken through an eventfd, which it can wait
+// on with poll or epoll alongside its other file descriptors. event_fd_new
+// returns -1 where there are no eventfds. event_fd_signal makes the fd
+// readable, and event_fd_clear makes it unreadable until the next signal.
+#ifdef __linux__
+#define has_eventfd 1
+
+static inline int event_fd_new() {
+  return eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+static inline void event_fd_signal(int fd) {
+  eventfd_write(fd, 1);
+}
+
+static inline void event_fd_clear(int fd) {
+  eventfd_t value;
+  eventfd_read(fd, &value);
+}
+#else
+#define has_eventfd 0
+
+static inline int  event_fd_new()          { return -1; }
+static inline void event_fd_signal(int fd) {}
+static inline void event_fd_clear(int fd)  {}
+#endif
+
+// Bytes used to keep independently-written fields on different cache lines.
+#define cache_line_size 64
+
+
+///////////////////////////////////////////////////////////////////////////////
+// System information.
+
+// Returns nanoseconds from an arbitrary fixed point in the past.
+static inline int64_t clock_ns() {
+#ifdef _WIN32
+  LARGE_INTEGER count, freq;
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return (int64_t)((double)count.QuadPart * 1e9 / freq.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// Returns a fast-running, monotonic count of cpu ticks. On x86 this is the time
+// stamp counter, which is cheaper to read than clock_ns and runs at a constant
+// rate on modern cpus; callers convert ticks to time by sampling both clocks.
+// Elsewhere, this is clock_ns.
+static inline int64_t cpu_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return (int64_t)__builtin_ia32_rdtsc();
+#else
+  return clock_ns();
+#endif
+}
+
+static inline int num_cpus() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int)info.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+#endif
+}
@@ -0,0 +1,209 @@
+// pool.c
+//
+// https://github.com/tylerneylon/thready
+//
+// A message allocator built on per-thread pools, for thready__msg_alloc and
+// thready__msg_free. Inbox envelopes come from the same pools.
+//
+// Each OS thread allocates from its own pool, which keeps a free list for each
+// size class. Every block starts with a header naming the pool it came from.
+// A thread freeing its own block just pushes it onto the right free list. A
+// thread freeing another thread's block, which is the usual case for messages,
+// collects such blocks in a short chain and hands the whole chain back to the
+// owning pool with one atomic operation once the chain is full, or when the
+// thread sleeps or returns from a nonblocking runloop. The owner picks up
+// returned blocks in one exchange when one of its free lists runs dry.
+//
+// Block sizes, headers included, are powers of 2, and slabs start on a cache
+// line, so every block of 64 bytes or more starts on a cache line, and a
+// 64-byte block fills exactly one.
+//
+// Memory in the pools is never given back to the system. When a thread exits,
+// its pool is adopted by the next new thread.
+//
+
+#include "internal.h"
+
+#include <stdlib.h>
+
+
+// Internal types.
+
+#define num_classes       9     // Blocks are 32, 64, ..., 8192 bytes.
+#define min_block_size    32
+#define slab_size         16384 // Bytes carved into blocks at a time.
+#define max_return_chain  64
+
+// This keeps payloads 16-byte aligned, like malloc's.
+#define header_size 16
+
+typedef struct Pool Pool;
+
+typedef struct {
+  Pool *  pool;        // NULL for blocks that are too big for the pools.
+  int     size_class;
+} Header;
+
+// Free blocks are linked through their payloads.
+typedef struct Block {
+  struct Block *next;
+} Block;
+
+struct Pool {
+  // This is pushed to by other threads.
+  Block *  returned;
+
+  char     padding[cache_line_size];
+
+  // These are only used by the owning thread.
+  Block *  free_lists[num_classes];
+  Pool *   next_orphan;
+};
+
+
+// Internal data.
+
+static thread_local Pool *  current_pool = NULL;
+
+// Blocks freed by this thread that belong to return_pool.
+static thread_local Pool *  return_pool  = NULL;
+static thread_local Block * return_first = NULL;
+static thread_local Block * return_last  = NULL;
+static thread_local int     num_to_return = 0;
+
+// Pools of exited threads, waiting to be adopted.
+static Pool *           orphans       = NULL;
+static pthread_mutex_t  orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Internal functions.
+
+static Header *header_of(void *ptr) {
+  return (Header *)((char *)ptr - header_size);
+}
+
+static Pool *get_pool() {
+  if (current_pool) return current_pool;
+
+  pthread_mutex_lock(&orphans_mutex);
+  current_pool = orphans;
+  if (orphans) orphans = orphans->next_orphan;
+  pthread_mutex_unlock(&orphans_mutex);
+
+  if (current_pool == NULL) current_pool = calloc(1, sizeof(Pool));
+  return current_pool;
+}
+
+// Moves the blocks other threads have returned into our free lists.
+static void take_returned(Pool *pool) {
+  Block *block = atomic__swap(&pool->returned, NULL);
+  while (block) {
+    Block *next = block->next;
+    int size_class = header_of(block)->size_class;
+    block->next = pool->free_lists[size_class];
+    pool->free_lists[size_class] = block;
+    block = next;
+  }
+}
+
+// Carves a slab into blocks for the given size class.
+static void add_slab(Pool *pool, int size_class) {
+  int block_size = min_block_size << size_class;
+  int num_blocks = slab_size / block_size;
+  if (num_blocks < 4) num_blocks = 4;
+
+  // Slabs are never freed, so we can skip ahead to a cache line.
+  char *slab = malloc(num_blocks * block_size + cache_line_size);
+  if (slab == NULL) return;
+  slab += (cache_line_size - (uintptr_t)slab % cache_line_size) %
+          cache_line_size;
+  for (int i = 0; i < num_blocks; ++i) {
+    Header *header     = (Header *)(slab + i * block_size);
+    header->pool       = pool;
+    header->size_class = size_class;
+    Block *block = (Block *)((char *)header + header_size);
+    block->next = pool->free_lists[size_class];
+    pool->free_lists[size_class] = block;
+  }
+}
+
+static void push_returned(Pool *pool, Block *first, Block *last) {
+  Block *head = atomic__load_relaxed(&pool->returned);
+  do {
+    last->next = head;
+  } while (!atomic__cas(&pool->returned, &head, first));
+}
+
+
+// Functions shared with other files.
+
+void pool__flush_returns() {
+  if (num_to_return == 0) return;
+  push_returned(return_pool, return_first, return_last);
+  return_pool   = NULL;
+  num_to_return = 0;
+}
+
+void pool__release() {
+  pool__flush_returns();
+  if (current_pool == NULL) return;
+
+  pthread_mutex_lock(&orphans_mutex);
+  current_pool->next_orphan = orphans;
+  orphans = current_pool;
+  pthread_mutex_unlock(&orphans_mutex);
+
+  current_pool = NULL;
+}
+
+
+// Public functions.
+
+void *thready__msg_alloc(size_t size) {
+  if (size > (min_block_size << (num_classes - 1)) - header_size) {
+    Header *header = malloc(header_size + size);
+    if (header == NULL) return NULL;
+    header->pool = NULL;
+    return (char *)header + header_size;
+  }
+
+  int size_class = 0;
+  while ((size_t)(min_block_size << size_class) - header_size < size) {
+    size_class++;
+  }
+
+  Pool *pool = get_pool();
+  if (pool == NULL) return NULL;
+  if (pool->free_lists[size_class] == NULL) take_returned(pool);
+  if (pool->free_lists[size_class] == NULL) add_slab(pool, size_class);
+
+  Block *block = pool->free_lists[size_class];
+  if (block == NULL) return NULL;
+  pool->free_lists[size_class] = block->next;
+  return block;
+}
+
+void thready__msg_free(void *ptr) {
+  if (ptr == NULL) return;
+
+  Header *header = header_of(ptr);
+  Pool *  pool   = header->pool;
+  Block * block  = (Block *)ptr;
+
+  if (pool == NULL) {
+    free(header);
+  } else if (pool == current_pool) {
+    block->next = pool->free_lists[header->size_class];
+    pool->free_lists[header->size_class] = block;
+  } else {
+    if (pool != return_pool) pool__flush_returns();
+    if (num_to_return == 0) {
+      return_pool  = pool;
+      return_first = NULL;
+      return_last  = block;
+    }
+    block->next  = return_first;
+    return_first = block;
+    if (++num_to_return == max_return_chain) pool__flush_returns();
+  }
+}
@@ -94,10 +94,20 @@ void pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
   SleepConditionVariableCS(cond, mutex, INFINITE);  // INFINITE --> timeout
 }
 
+void pthread_cond_wait_ns(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                          int64_t timeout_ns) {
+  // Round up so that we never wake before the timeout.
+  SleepConditionVariableCS(cond, mutex, (DWORD)((timeout_ns + 999999) / 1000000));
+}
+
 void pthread_cond_signal(pthread_cond_t *cond) {
   WakeConditionVariable(cond);
 }
 
+void pthread_cond_broadcast(pthread_cond_t *cond) {
+  WakeAllConditionVariable(cond);
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // One-time initialization.
@@ -10,6 +10,8 @@
 #ifndef _WIN32
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 #define pthread_rwlock_rdunlock pthread_rwlock_unlock
 #define pthread_rwlock_wrunlock pthread_rwlock_unlock
@@ -17,8 +19,22 @@
 
 int pthread_mutex_is_locked(pthread_mutex_t *m);
 
+// Not an actual pthreads function. This is pthread_cond_wait with a timeout,
+// given in nanoseconds from now.
+static inline void pthread_cond_wait_ns(pthread_cond_t *cond,
+                                        pthread_mutex_t *mutex,
+                                        int64_t timeout_ns) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  int64_t ns = ts.tv_nsec + timeout_ns;
+  ts.tv_sec += ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  pthread_cond_timedwait(cond, mutex, &ts);
+}
+
 #else
 
+#include <stdint.h>
 #include <windows.h>
 
 
@@ -67,6 +83,12 @@ int pthread_mutex_is_locked(pthread_mutex_t *m);
 
 void pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
 void pthread_cond_signal(pthread_cond_t *cond);
+void pthread_cond_broadcast(pthread_cond_t *cond);
+
+// Not an actual pthreads function. This is pthread_cond_wait with a timeout,
+// given in nanoseconds from now.
+void pthread_cond_wait_ns(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                          int64_t timeout_ns);
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,178 @@
+// reactor.c
+//
+// https://github.com/tylerneylon/thready
+//
+// Delivers fd readiness as messages for thready__watch_fd.
+//
+// A single internal thread waits on an epoll set, and sends a thready__FdEvent
+// to the watcher of each fd that becomes ready. Watches are one-shot
+// (EPOLLONESHOT), so an fd that stays ready doesn't flood its watcher: the
+// watcher handles each event, typically by reading or writing until the fd
+// would block, and then watches the fd again. Like the timer thread, the
+// reactor sends regardless of inbox capacity, so that a busy watcher never
+// holds up the other fds.
+//
+// Watchers are kept in a table indexed by fd. The reactor reads the table
+// under watches_mutex, which thready__unwatch_fd also takes, so no event is
+// sent for an fd once thready__unwatch_fd returns. A watcher that has exited is
+// unwatched the next time its fd is ready.
+//
+
+#include "internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#endif
+
+
+#ifdef __linux__
+
+// Internal types and data.
+
+#define max_events_per_wait 64
+
+// These are guarded by watches_mutex.
+static thready__Id *    watchers      = NULL;  // Indexed by fd; NULL entries
+                                               // are unwatched.
+static int              num_watchers  = 0;     // The length of `watchers`.
+static pthread_mutex_t  watches_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int              epoll_fd      = -1;
+static pthread_once_t   reactor_control = PTHREAD_ONCE_INIT;
+
+
+// Internal functions.
+
+static int events_of(uint32_t epoll_events) {
+  int events = 0;
+  if (epoll_events & EPOLLIN)  events |= thready__fd_read;
+  if (epoll_events & EPOLLOUT) events |= thready__fd_write;
+  if (epoll_events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+    events |= thready__fd_hangup;
+  }
+  return events;
+}
+
+static uint32_t epoll_events_of(int events) {
+  uint32_t epoll_events = EPOLLONESHOT;
+  if (events & thready__fd_read)  epoll_events |= EPOLLIN | EPOLLRDHUP;
+  if (events & thready__fd_write) epoll_events |= EPOLLOUT;
+  return epoll_events;
+}
+
+// Returns 0 if we're out of memory. The caller must hold watches_mutex.
+static int make_room_for(int fd) {
+  if (fd < num_watchers) return 1;
+  int n = num_watchers ? num_watchers : 64;
+  while (n <= fd) n *= 2;
+  thready__Id *new_watchers = realloc(watchers, n * sizeof(thready__Id));
+  if (new_watchers == NULL) return 0;
+  for (int i = num_watchers; i < n; ++i) new_watchers[i] = NULL;
+  watchers     = new_watchers;
+  num_watchers = n;
+  return 1;
+}
+
+// The caller must hold watches_mutex.
+static void remove_watch(int fd) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  watchers[fd] = NULL;
+}
+
+static void *reactor_runner(void *unused) {
+  struct epoll_event events[max_events_per_wait];
+  while (1) {
+    // This returns -1 if it's interrupted by a signal.
+    int n = epoll_wait(epoll_fd, events, max_events_per_wait, -1);
+    pthread_mutex_lock(&watches_mutex);
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd >= num_watchers || watchers[fd] == NULL) continue;
+      thready__FdEvent event = { .fd     = fd,
+                                 .events = events_of(events[i].events) };
+      if (inbox__force_send(watchers[fd], &event, sizeof(event),
+                            thready__reactor) == thready__error) {
+        remove_watch(fd);
+      }
+    }
+    pthread_mutex_unlock(&watches_mutex);
+  }
+  return NULL;
+}
+
+static void start_reactor() {
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) return;
+  pthread_t pthread;
+  int err = pthread_create(&pthread,        // receive thread id
+                           NULL,            // NULL --> use default attributes
+                           reactor_runner,  // init function
+                           NULL);           // init function arg
+
+  // Without the thread, no event would ever be delivered, so we fail every
+  // watch instead.
+  if (err) {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
+}
+
+
+// Public functions.
+
+thready__Id thready__watch_fd(int fd, int events, thready__Id to) {
+  int all_events = thready__fd_read | thready__fd_write;
+  if (fd < 0 || events == 0 || (events & ~all_events) ||
+      thread__of(to) == NULL) {
+    return thready__error;
+  }
+
+  pthread_once(&reactor_control, start_reactor);
+  if (epoll_fd == -1) return thready__error;
+
+  struct epoll_event event = { .events = epoll_events_of(events),
+                               .data.fd = fd };
+  pthread_mutex_lock(&watches_mutex);
+  int err = !make_room_for(fd);
+  if (!err) {
+    // Closing an fd takes it out of the epoll set without updating
+    // `watchers`, so if one operation fails, the other may work.
+    int op = watchers[fd] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    err = epoll_ctl(epoll_fd, op, fd, &event);
+    if (err && (errno == ENOENT || errno == EEXIST)) {
+      op  = (op == EPOLL_CTL_MOD) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+      err = epoll_ctl(epoll_fd, op, fd, &event);
+    }
+  }
+  if (!err) watchers[fd] = to;
+  pthread_mutex_unlock(&watches_mutex);
+
+  return err ? thready__error : thready__success;
+}
+
+thready__Id thready__unwatch_fd(int fd) {
+  pthread_mutex_lock(&watches_mutex);
+  int is_watched = (fd >= 0 && fd < num_watchers && watchers[fd]);
+  if (is_watched) remove_watch(fd);
+  pthread_mutex_unlock(&watches_mutex);
+
+  return is_watched ? thready__success : thready__error;
+}
+
+#else  // __linux__
+
+// Public functions.
+
+thready__Id thready__watch_fd(int fd, int events, thready__Id to) {
+  return thready__error;
+}
+
+thready__Id thready__unwatch_fd(int fd) {
+  return thready__error;
+}
+
+#endif
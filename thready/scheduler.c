@@ -0,0 +1,377 @@
+// scheduler.c
+//
+// https://github.com/tylerneylon/thready
+//
+// Runs actors created with thready__spawn on a fixed pool of worker threads.
+//
+// An actor has an inbox and a receiver, but no OS thread of its own. The
+// sender that takes an actor's inbox_count from 0 to 1 makes the actor ready.
+// A worker picks up the actor, dispatches the batch of messages in its inbox,
+// and then retires those messages from inbox_count. If more messages arrived
+// in the meantime, the worker makes the actor ready again. This way each actor
+// is run by at most one worker at a time.
+//
+// Ready actors are kept in per-worker Chase-Lev deques. A send from within an
+// actor pushes the recipient onto the current worker's own deque, so that it's
+// normally run by the same, cache-warm worker; idle workers steal from the
+// other end of a random victim's deque. Sends from outside the pool, and
+// pushes that don't fit in a deque, go to a shared queue. With the
+// thready__shared_queue scheduling policy, all ready actors go to the shared
+// queue; this is mainly useful for comparison.
+//
+
+#include "internal.h"
+
+#include <setjmp.h>
+#include <stdlib.h>
+
+
+// Internal types.
+
+#define deque_size 4096  // Must be a power of 2.
+
+// A Chase-Lev work-stealing deque with a fixed-size buffer. Only the owning
+// worker pushes and takes at the bottom; any worker may steal from the top.
+// This follows "Correct and Efficient Work-Stealing for Weak Memory Models" by
+// Le, Pop, Cohen and Zappa Nardelli.
+typedef struct {
+  long     top;
+  char     padding[cache_line_size];
+  long     bottom;
+  Thread * buffer[deque_size];
+} Deque;
+
+typedef struct {
+  Deque    deque;
+  unsigned rand_state;  // For choosing steal victims.
+  unsigned num_ticks;   // Counts scheduling decisions, for fairness.
+} Worker;
+
+
+// Internal data.
+
+// The shared queue is a FIFO linked through Thread.next_ready.
+static Thread *         ready_head   = NULL;
+static Thread *         ready_tail   = NULL;
+static pthread_mutex_t  ready_mutex  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   ready_signal = PTHREAD_COND_INITIALIZER;
+
+// Workers sleeping on ready_signal. Senders check this after making an actor
+// ready, and workers increment it before their last check for work.
+static int              num_sleeping = 0;
+
+// These can't change after the pool starts. 0 workers means one per cpu.
+// pool_is_started is guarded by ready_mutex, and pool_is_running is set once
+// the first actor may be made ready.
+static int              num_workers  = 0;
+static int              policy       = thready__work_stealing;
+static int              pool_is_started = 0;
+static int              pool_is_running = 0;
+static pthread_mutex_t  start_mutex  = PTHREAD_MUTEX_INITIALIZER;
+
+static Worker *         workers      = NULL;
+
+// The worker owning the calling thread, if any.
+static thread_local Worker *current_worker = NULL;
+
+// Set while a worker is dispatching an actor's messages, so that
+// thready__exit can return control to the worker.
+static thread_local jmp_buf *exit_jump = NULL;
+
+
+// Internal functions.
+
+// Returns 0 if the deque is full. Only the owner calls this.
+static int deque_push(Deque *deque, Thread *actor) {
+  long b = atomic__load_relaxed(&deque->bottom);
+  long t = atomic__load_acq(&deque->top);
+  if (b - t >= deque_size) return 0;
+  atomic__store_relaxed(&deque->buffer[b & (deque_size - 1)], actor);
+  atomic__fence_rel();
+  atomic__store_relaxed(&deque->bottom, b + 1);
+  return 1;
+}
+
+// Takes the most recently pushed actor, or returns NULL if the deque is empty.
+// Only the owner calls this.
+static Thread *deque_take(Deque *deque) {
+  long b = atomic__load_relaxed(&deque->bottom) - 1;
+  atomic__store_relaxed(&deque->bottom, b);
+  atomic__fence();
+  long t = atomic__load_relaxed(&deque->top);
+
+  if (t > b) {
+    atomic__store_relaxed(&deque->bottom, b + 1);
+    return NULL;
+  }
+
+  Thread *actor = atomic__load_relaxed(&deque->buffer[b & (deque_size - 1)]);
+  if (t == b) {
+    // This is the last actor, so we race with stealers for it.
+    if (!atomic__cas(&deque->top, &t, t + 1)) actor = NULL;
+    atomic__store_relaxed(&deque->bottom, b + 1);
+  }
+  return actor;
+}
+
+// Takes the least recently pushed actor. Returns NULL if the deque is empty,
+// and sets *is_contended if we lost a race for an actor instead.
+static Thread *deque_steal(Deque *deque, int *is_contended) {
+  long t = atomic__load_acq(&deque->top);
+  atomic__fence();
+  long b = atomic__load_acq(&deque->bottom);
+  if (t >= b) return NULL;
+
+  Thread *actor = atomic__load_relaxed(&deque->buffer[t & (deque_size - 1)]);
+  if (!atomic__cas(&deque->top, &t, t + 1)) {
+    *is_contended = 1;
+    return NULL;
+  }
+  return actor;
+}
+
+// Tries every other worker's deque, starting at a random one.
+static Thread *steal_from_others(Worker *worker, int n) {
+  if (n < 2) return NULL;
+
+  // This is xorshift32.
+  unsigned x = worker->rand_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  worker->rand_state = x;
+
+  int is_contended;
+  do {
+    is_contended = 0;
+    int start = (int)(x % n);
+    for (int i = 0; i < n; ++i) {
+      Worker *victim = workers + (start + i) % n;
+      if (victim == worker) continue;
+      Thread *actor = deque_steal(&victim->deque, &is_contended);
+      if (actor) return actor;
+    }
+  } while (is_contended);
+  return NULL;
+}
+
+// The caller must hold ready_mutex.
+static Thread *shared_queue_pop() {
+  Thread *actor = ready_head;
+  if (actor) {
+    atomic__store_relaxed(&ready_head, actor->next_ready);
+    if (ready_head == NULL) ready_tail = NULL;
+  }
+  return actor;
+}
+
+// This skips the lock when the shared queue looks empty.
+static Thread *shared_queue_try_pop() {
+  if (atomic__load_relaxed(&ready_head) == NULL) return NULL;
+  pthread_mutex_lock(&ready_mutex);
+  Thread *actor = shared_queue_pop();
+  pthread_mutex_unlock(&ready_mutex);
+  return actor;
+}
+
+static Thread *find_ready_actor(Worker *worker, int n) {
+  Thread *actor = NULL;
+  unsigned tick = worker->num_ticks++;
+  int dummy;
+
+  // The deque is LIFO for its owner, which is best for cache locality. We
+  // occasionally take from its other end, and from the shared queue, so that
+  // no ready actor waits forever.
+  if (tick % 61 == 0) actor = shared_queue_try_pop();
+  if (!actor && tick % 31 == 0) actor = deque_steal(&worker->deque, &dummy);
+  if (!actor) actor = deque_take(&worker->deque);
+  if (!actor) actor = shared_queue_try_pop();
+  if (!actor) actor = steal_from_others(worker, n);
+  return actor;
+}
+
+static Thread *next_ready_actor(Worker *worker, int n) {
+  if (policy == thready__work_stealing) {
+    Thread *actor = find_ready_actor(worker, n);
+    if (actor) return actor;
+  }
+
+  // Our own deque is empty, and only we push to it, so we only need to check
+  // the shared queue and other workers here.
+  int may_steal = (policy == thready__work_stealing);
+  pool__flush_returns();
+  pthread_mutex_lock(&ready_mutex);
+  atomic__add(&num_sleeping, 1);
+  Thread *actor;
+  while ((actor = shared_queue_pop()) == NULL &&
+         (!may_steal || (actor = steal_from_others(worker, n)) == NULL)) {
+    pthread_cond_wait(&ready_signal, &ready_mutex);
+  }
+  atomic__add(&num_sleeping, -1);
+  pthread_mutex_unlock(&ready_mutex);
+  return actor;
+}
+
+// Dispatches the actor's batch on the worker's own stack. Returns
+// coroutine__exited if the actor called thready__exit, and coroutine__done
+// otherwise.
+static int dispatch(Thread *actor) {
+  jmp_buf jump;
+  if (setjmp(jump)) {
+    exit_jump = NULL;
+    return coroutine__exited;
+  }
+  exit_jump = &jump;
+  thread__dispatch(actor, actor->receiver);
+  exit_jump = NULL;
+  return coroutine__done;
+}
+
+static void run_actor(Thread *actor) {
+  // A suspended coroutine has already taken its batch. Otherwise, the actor is
+  // only made ready once a message has been announced, so a 0 here means the
+  // sender hasn't finished linking it in yet.
+  if (actor->coroutine == NULL) {
+    while ((actor->num_taken = inbox__take_all(actor)) == 0) thread_yield();
+  }
+
+  thread__set_current(actor);
+  int status = coroutine__no_stack;
+  if (actor->is_coroutine) status = coroutine__run(actor);
+  if (status == coroutine__no_stack) status = dispatch(actor);
+  thread__set_current(NULL);
+
+  // A suspended actor keeps its batch, and so its nonzero inbox_count, until
+  // the reply makes it ready again.
+  if (status == coroutine__suspended) return;
+  if (status == coroutine__exited) {
+    thread__release(actor);
+    return;
+  }
+
+  // Until the retire, no sender will make this actor ready, so we do it
+  // ourselves if more messages are waiting. num_taken is cleared first, since
+  // once the retire is done another worker may pick up the actor.
+  int num_taken    = actor->num_taken;
+  actor->num_taken = 0;
+  if (inbox__retire(actor, num_taken) > 0) scheduler__make_ready(actor);
+}
+
+static void *worker_runner(void *worker_vp) {
+  Worker *worker = (Worker *)worker_vp;
+  current_worker = worker;
+  int n = num_workers;
+  while (1) run_actor(next_ready_actor(worker, n));
+  return NULL;
+}
+
+// Returns 0 if no worker could be started, in which case the pool can be
+// started again later, perhaps with fewer workers. The caller must hold
+// start_mutex.
+static int start_pool() {
+  pthread_mutex_lock(&ready_mutex);
+  pool_is_started = 1;
+  if (num_workers == 0) num_workers = num_cpus();
+  pthread_mutex_unlock(&ready_mutex);
+
+  workers = calloc(num_workers, sizeof(Worker));
+  int num_started = 0;
+  if (workers) {
+    for (int i = 0; i < num_workers; ++i) {
+      workers[i].rand_state = 2463534242u + i;  // Any nonzero seed works.
+    }
+
+    // A worker that fails to start leaves an empty deque behind. Only its
+    // owner pushes to a deque, so others just find nothing to steal there.
+    for (int i = 0; i < num_workers; ++i) {
+      pthread_t pthread;
+      int err = pthread_create(&pthread,       // receive thread id
+                               NULL,           // NULL --> default attributes
+                               worker_runner,  // init function
+                               workers + i);   // init function arg
+      if (!err) num_started++;
+    }
+  }
+
+  if (num_started == 0) {
+    free(workers);
+    workers = NULL;
+    pthread_mutex_lock(&ready_mutex);
+    pool_is_started = 0;
+    pthread_mutex_unlock(&ready_mutex);
+  }
+  return num_started > 0;
+}
+
+
+// Functions shared with thready.c.
+
+thready__Id scheduler__start() {
+  if (atomic__load_acq(&pool_is_running)) return thready__success;
+  pthread_mutex_lock(&start_mutex);
+  int is_running = pool_is_running || start_pool();
+  if (is_running) atomic__store_rel(&pool_is_running, 1);
+  pthread_mutex_unlock(&start_mutex);
+  return is_running ? thready__success : thready__error;
+}
+
+void scheduler__make_ready(Thread *actor) {
+  Worker *worker = current_worker;
+  if (worker && policy == thready__work_stealing &&
+      deque_push(&worker->deque, actor)) {
+    // Make the push visible before we check for sleeping workers.
+    atomic__fence();
+    if (atomic__load(&num_sleeping) == 0) return;
+    pthread_mutex_lock(&ready_mutex);
+    pthread_cond_signal(&ready_signal);
+    pthread_mutex_unlock(&ready_mutex);
+    return;
+  }
+
+  actor->next_ready = NULL;
+  pthread_mutex_lock(&ready_mutex);
+  if (ready_tail) {
+    ready_tail->next_ready = actor;
+  } else {
+    atomic__store_relaxed(&ready_head, actor);
+  }
+  ready_tail = actor;
+  pthread_cond_signal(&ready_signal);
+  pthread_mutex_unlock(&ready_mutex);
+}
+
+void scheduler__exit_actor() {
+  Thread *actor = thread__current();
+  if (actor->coroutine) coroutine__exit(actor);
+  longjmp(*exit_jump, 1);
+}
+
+
+// Public functions.
+
+thready__Id thready__set_num_workers(int n) {
+  if (n < 0) return thready__error;
+  pthread_mutex_lock(&ready_mutex);
+  thready__Id result = thready__error;
+  if (!pool_is_started) {
+    num_workers = n;
+    result = thready__success;
+  }
+  pthread_mutex_unlock(&ready_mutex);
+  return result;
+}
+
+thready__Id thready__set_scheduling(int new_policy) {
+  if (new_policy != thready__work_stealing &&
+      new_policy != thready__shared_queue) {
+    return thready__error;
+  }
+  pthread_mutex_lock(&ready_mutex);
+  thready__Id result = thready__error;
+  if (!pool_is_started) {
+    policy = new_policy;
+    result = thready__success;
+  }
+  pthread_mutex_unlock(&ready_mutex);
+  return result;
+}
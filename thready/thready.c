@@ -9,11 +9,14 @@
 
 #include "thready.h"
 
-#include "../cstructs/cstructs.h"
+#include "internal.h"
 
-#include "pthreads_win.h"  // <pthread.h> or a wrapper for it based on OS.
+#include "../cstructs/cstructs.h"
 
+#include <limits.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 // This may be useful for debugging.
 #if 0
@@ -26,26 +29,65 @@
 
 // Internal types and data.
 
-typedef struct {
-  void *   msg;
-  thready__Id from;
-} Envelope;
+// Threads and actors live in slots, which are allocated in chunks that are
+// never moved or freed. That way a Thread stays safe to read even after its
+// thread exits, and an id can be checked without a lock: an id packs a slot
+// index, plus one, into its low half and the slot's generation into its high
+// half. Freeing a slot changes its generation, so the old id becomes stale.
+// Generations are never 0, so no id equals thready__error, thready__success or
+// thready__full.
+//
+// A sender counts itself in the slot's num_senders before it checks the id,
+// and stays counted until its message is in the inbox. When a thread exits,
+// thread__release changes the generation and then waits for the count to reach
+// zero, so every send either fails the check or finishes before the inbox is
+// emptied for the last time. A freed slot never receives another message for
+// its old id, and can be reused right away. Freed slots are reused in FIFO
+// order, so that a generation takes as long as possible to come around again.
+#define slots_per_chunk  256
+#define max_chunks       65536
 
-typedef struct {
-  Array            inbox;
-  pthread_mutex_t  inbox_mutex;
-  pthread_cond_t   inbox_signal;  // Goes off when the inbox becomes nonempty.
-} Thread;
+#define index_bits (sizeof(uintptr_t) * 4)
+#define index_mask (((uintptr_t)1 << index_bits) - 1)
 
-// Maps pthread_t -> Thread *.
-static Map threads = NULL;
+static Thread *         chunks[max_chunks];
+static int              num_chunks = 0;
+static uintptr_t        num_slots  = 0;     // Slots handed out at least once.
 
-// This is the lock for `threads`.
-static pthread_rwlock_t threads_lock = PTHREAD_RWLOCK_INITIALIZER;
+// Freed slots, oldest first, linked through next_ready.
+static Thread *         free_head  = NULL;
+static Thread *         free_tail  = NULL;
+static int              num_free   = 0;
+
+// This guards the slot data above, and each slot's is_live.
+static pthread_mutex_t  slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The calling thread's Thread, once it's known.
+static thread_local Thread *current_thread = NULL;
 
 // This is a thread-safe way to make sure init is called exactly once.
 static pthread_once_t init_control = PTHREAD_ONCE_INIT;
 
+// The blocking runloop polls an empty inbox up to spin_budget times before
+// parking. Each thread tunes its budget from how soon messages show up after
+// it parks; see wait_for_msg.
+#define initial_spin_budget  128
+#define max_spin_budget      16384
+#define short_wait_ns        20000
+
+// Every this-many dispatches, the lowest lane with a batch goes first.
+#define starvation_period 16
+
+// Adds to one of a thread's stats counters. Only the thread's owner does this.
+#define stat_add(thread, counter, n) \
+    atomic__store_relaxed(&(thread)->counter, (thread)->counter + (n))
+
+// Used as the deadline of waits that have none.
+#define no_deadline INT64_MAX
+
+// This is 0 on a single cpu, where spinning only delays the sender.
+static int spin_budget_limit = -1;
+
 // Data for thready__create_once.
 static Map once_threads = NULL;  // Maps thready__Receiver -> Thread *.
 static pthread_rwlock_t once_threads_lock = PTHREAD_RWLOCK_INITIALIZER;
@@ -61,52 +103,780 @@ static int eq(void *v1, void *v2) {
   return v1 == v2;
 }
 
+// Adds the linked envelopes first..last to the end of the given inbox lane.
+// This may be called from any thread.
+static void inbox_push(Thread *thread, int lane, Envelope *first,
+                       Envelope *last) {
+  last->next = NULL;
+  Envelope *prev = atomic__swap(&thread->lane_heads[lane], last);
+  // Until this store, the consumer can't see first..last; see take_lane.
+  atomic__store_rel(&prev->next, first);
+}
+
+// Moves every linked envelope in the given lane into thread->batches[lane],
+// which must be empty, as a NULL-terminated list, oldest first. Returns the
+// number of envelopes moved. This is only called by the thread owning the
+// inbox.
+static int take_lane(Thread *thread, int lane) {
+  Envelope *stub  = &thread->lane_stubs[lane];
+
+  // The stub is only ever at the tail, so this leaves it out of the batch.
+  Envelope *first = atomic__load_acq(&stub->next);
+  if (first == NULL) return 0;
+
+  // Nobody links to the stub now, so it's safe to reset it and make it the
+  // head. Senders that swap after this point link after the stub.
+  stub->next     = NULL;
+  Envelope *last = atomic__swap(&thread->lane_heads[lane], stub);
+
+  // Senders that swapped before us may not have linked their envelopes yet.
+  int num_taken = 1;
+  for (Envelope *envelope = first; envelope != last; ++num_taken) {
+    Envelope *next;
+    while ((next = atomic__load_acq(&envelope->next)) == NULL) thread_yield();
+    envelope = next;
+  }
+
+  thread->batches[lane] = first;
+  thread->num_batched  += num_taken;
+  trace__event(trace__dequeue, thread->id, NULL, num_taken, NULL);
+  return num_taken;
+}
+
+// Takes every lane whose batch is empty. This returns 0 if the inbox is empty,
+// which may also mean that a sender is between the two steps of inbox_push;
+// the caller can use inbox_count to tell the difference.
+int inbox__take_all(Thread *thread) {
+  int depth = atomic__load_relaxed(&thread->inbox_count) - thread->num_taken +
+              thread->num_batched;
+  if (depth > thread->max_inbox_depth) {
+    atomic__store_relaxed(&thread->max_inbox_depth, depth);
+  }
+
+  int num_taken = 0;
+  for (int lane = 0; lane < num_lanes; ++lane) {
+    if (thread->batches[lane] == NULL) num_taken += take_lane(thread, lane);
+  }
+  return num_taken;
+}
+
+// Returns the envelope's pending call, or NULL if it has none, which includes
+// copies, whose payload overlaps the future field.
+static Future *future_of(Envelope *envelope) {
+  if (envelope->msg == (void *)&envelope->future) return NULL;
+  return envelope->future;
+}
+
+// Calls that were never replied to get a NULL reply from `thread`.
+static void free_envelopes(Thread *thread, Envelope *envelope) {
+  while (envelope) {
+    Envelope *next = envelope->next;
+    Future *future = future_of(envelope);
+    if (future) future__complete(future, NULL, thread->id);
+    if (envelope->from == channel__notice) channel__release(envelope->msg);
+    if (envelope->from == future__notice)  future__drop(envelope->msg);
+    thready__msg_free(envelope);
+    envelope = next;
+  }
+}
+
+static void free_batches(Thread *thread) {
+  for (int lane = 0; lane < num_lanes; ++lane) {
+    free_envelopes(thread, thread->batches[lane]);
+    thread->batches[lane] = NULL;
+  }
+}
+
+static uintptr_t next_generation(uintptr_t generation) {
+  generation = (generation + 1) & index_mask;
+  return generation ? generation : 1;
+}
+
+static int is_stale(Thread *thread, thready__Id id) {
+  return atomic__load(&thread->generation) != (uintptr_t)id >> index_bits;
+}
+
+// Sets up the parts of a slot that last for the life of the process: the
+// inbox lanes, inbox_count, and the synchronization objects. Senders with
+// stale ids may still touch these.
+static void init_slot(Thread *thread, uintptr_t index) {
+  for (int lane = 0; lane < num_lanes; ++lane) {
+    thread->lane_stubs[lane].next = NULL;
+    thread->lane_heads[lane]      = &thread->lane_stubs[lane];
+    thread->batches[lane]         = NULL;
+  }
+  thread->generation          = 1;
+  thread->index               = index;
+  thread->inbox_count         = 0;
+  thread->num_blocked_senders = 0;
+  thread->num_senders         = 0;
+  thread->event_fd            = -1;
+  thread->inbox_mutex         = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
+  thread->inbox_signal        = (pthread_cond_t)  PTHREAD_COND_INITIALIZER;
+  thread->space_signal        = (pthread_cond_t)  PTHREAD_COND_INITIALIZER;
+}
+
+// Returns a slot that has never been used, or NULL if we're out of slots or
+// memory. The caller must hold slots_mutex.
+static Thread *new_slot() {
+  if (num_slots + 1 >= index_mask) return NULL;  // The id's index is + 1.
+  if (num_slots == (uintptr_t)num_chunks * slots_per_chunk) {
+    if (num_chunks == max_chunks) return NULL;
+    Thread *chunk = calloc(slots_per_chunk, sizeof(Thread));
+    if (chunk == NULL) return NULL;
+    for (int i = 0; i < slots_per_chunk; ++i) {
+      init_slot(chunk + i, num_slots + i);
+    }
+    chunks[num_chunks] = chunk;
+    atomic__store_rel(&num_chunks, num_chunks + 1);  // Publish to thread__of.
+  }
+  uintptr_t index = num_slots++;
+  return chunks[index / slots_per_chunk] + index % slots_per_chunk;
+}
+
+// The caller must hold slots_mutex.
+static void push_free_slot(Thread *thread) {
+  thread->next_ready = NULL;
+  if (free_tail) free_tail->next_ready = thread; else free_head = thread;
+  free_tail = thread;
+  num_free++;
+}
+
+// Returns the oldest free slot, or a new slot. Returns NULL if there are no
+// slots left.
+static Thread *alloc_slot() {
+  pthread_mutex_lock(&slots_mutex);
+  Thread *thread = free_head;
+  if (thread) {
+    free_head = thread->next_ready;
+    if (free_head == NULL) free_tail = NULL;
+    num_free--;
+  } else {
+    thread = new_slot();
+  }
+  if (thread) atomic__store(&thread->is_live, 1);
+  pthread_mutex_unlock(&slots_mutex);
+  return thread;
+}
+
+// Returns NULL if there are no slots left.
 static Thread *new_thread_struct() {
-  Thread *thread       = malloc(sizeof(Thread));
-  thread->inbox        = array__new(4, sizeof(Envelope));
-  thread->inbox_mutex  = (pthread_mutex_t) PTHREAD_MUTEX_INITIALIZER;
-  thread->inbox_signal = (pthread_cond_t)  PTHREAD_COND_INITIALIZER;
+  Thread *thread = alloc_slot();
+  if (thread == NULL) return NULL;
+  thread->num_batched     = 0;
+  thread->num_taken       = 0;
+  thread->num_dispatched  = 0;
+  thread->num_sent        = 0;
+  thread->num_received    = 0;
+  thread->max_inbox_depth = 0;
+  thread->blocked_ns      = 0;
+  thread->handler_ns      = 0;
+  thread->in_use          = NULL;
+  thread->spin_budget     = spin_budget_limit > 0 ? initial_spin_budget : 0;
+  thread->is_waiting      = 0;
+  thread->has_event_fd    = 0;
+  thread->capacity        = 0;
+  thread->receiver        = NULL;
+  thread->name[0]         = '\0';
+  thread->is_actor        = 0;
+  thread->next_ready      = NULL;
+  thread->is_coroutine    = 0;
+  thread->coroutine       = NULL;
+  thread->id = (thready__Id)((thread->generation << index_bits) |
+                             (thread->index + 1));
   return thread;
 }
 
-static void thread_releaser(void *thread_vp, void *context) {
-  Thread *thread = (Thread *)thread_vp;
-  pthread_mutex_destroy(&thread->inbox_mutex);
-  array__delete(thread->inbox);
-  free(thread);
+#ifndef _WIN32
+
+// Sets up `attr` to match `attrs`. Returns 0 if `attrs` holds a value that we
+// can't use; the caller destroys `attr` either way.
+static int init_pthread_attr(pthread_attr_t *attr, const thready__Attrs *attrs) {
+  pthread_attr_init(attr);
+
+  if (attrs->stack_size) {
+    size_t stack_size = attrs->stack_size;
+    size_t min_size   = PTHREAD_STACK_MIN;
+    if (stack_size < min_size) stack_size = min_size;
+    if (pthread_attr_setstacksize(attr, stack_size)) return 0;
+  }
+
+#ifdef __linux__
+  if (attrs->num_cpus) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int i = 0; i < attrs->num_cpus; ++i) {
+      if (attrs->cpus[i] < 0 || attrs->cpus[i] >= CPU_SETSIZE) return 0;
+      CPU_SET(attrs->cpus[i], &cpus);
+    }
+    if (pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus)) return 0;
+  }
+#endif
+
+  if (attrs->sched_policy != thready__sched_default) {
+    int policies[] = { 0, SCHED_OTHER, SCHED_FIFO, SCHED_RR };
+    struct sched_param param = { .sched_priority = attrs->sched_priority };
+    if (pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED) ||
+        pthread_attr_setschedpolicy(attr, policies[attrs->sched_policy]) ||
+        pthread_attr_setschedparam(attr, &param)) {
+      return 0;
+    }
+  }
+
+  return 1;
 }
 
+#endif
+
 static void init() {
-  threads = map__new(hash, eq);
-  threads->value_releaser = thread_releaser;
-  
+  spin_budget_limit = num_cpus() > 1 ? max_spin_budget : 0;
+
   // Once-threads are designed to run until the process completes, so there is
   // no releaser.
   once_threads = map__new(hash, eq);
+}
+
+Thread *thread__current() {
+  if (current_thread) return current_thread;
+  pthread_once(&init_control, init);
+  current_thread = new_thread_struct();
+  return current_thread;
+}
+
+// Returns the slot that `id` points to, whether or not the id is stale, or
+// NULL if it points to no slot.
+static Thread *slot_of(thready__Id id) {
+  uintptr_t index = ((uintptr_t)id & index_mask) - 1;
+  if (index >= (uintptr_t)atomic__load_acq(&num_chunks) * slots_per_chunk) {
+    return NULL;
+  }
+  return chunks[index / slots_per_chunk] + index % slots_per_chunk;
+}
+
+Thread *thread__of(thready__Id id) {
+  Thread *thread = slot_of(id);
+  return (thread == NULL || is_stale(thread, id)) ? NULL : thread;
+}
+
+void thread__set_current(Thread *thread) {
+  current_thread = thread;
+}
+
+void thread__release(Thread *thread) {
+  pthread_mutex_lock(&slots_mutex);
+  atomic__store(&thread->is_live, 0);
+  pthread_mutex_unlock(&slots_mutex);
+
+  // From here on, sends to the old id fail.
+  atomic__store(&thread->generation, next_generation(thread->generation));
+
+  // Senders waiting for space notice the new generation and give up.
+  pthread_mutex_lock(&thread->inbox_mutex);
+  pthread_cond_broadcast(&thread->space_signal);
+  pthread_mutex_unlock(&thread->inbox_mutex);
+
+  // Senders that got past the check before the change finish their sends, so
+  // that their messages are freed below. An actor's inbox_count is still
+  // nonzero here, so none of them makes it ready again.
+  while (atomic__load(&thread->num_senders)) thread_yield();
 
-  pthread_rwlock_wrlock(&threads_lock);
-  Thread *thread = new_thread_struct();
-  map__set(threads, (void *)(intptr_t)pthread_self(), thread);
-  pthread_rwlock_wrunlock(&threads_lock);
+  // An actor's taken messages are only retired after they're dispatched.
+  free_envelopes(thread, thread->in_use);
+  thread->in_use = NULL;
+  free_batches(thread);
+  int num_to_retire = thread->num_taken + inbox__take_all(thread);
+  free_batches(thread);
+  thread->num_batched = 0;
+  thread->num_taken   = 0;
+  atomic__add(&thread->inbox_count, -num_to_retire);
+
+  pthread_mutex_lock(&slots_mutex);
+  push_free_slot(thread);
+  pthread_mutex_unlock(&slots_mutex);
 }
 
 // This function runs the primary loop of all threads created with thready.
-static void *thread_runner(void *receiver_vp) {
-  thready__Receiver receiver = (thready__Receiver)receiver_vp;
+static void *thread_runner(void *thread_vp) {
+  current_thread = (Thread *)thread_vp;
+  if (current_thread->name[0]) {
+#if defined(__APPLE__)
+    pthread_setname_np(current_thread->name);  // Only works on the caller.
+#elif defined(__linux__)
+    pthread_setname_np(pthread_self(), current_thread->name);
+#endif
+  }
+  thready__Receiver receiver = current_thread->receiver;
   while (1) thready__runloop(receiver, thready__blocking);
   return NULL;
 }
 
-static void send_out_first_msg(Thread *thread, thready__Receiver receiver) {
-  // Read out the first message and remove it from the inbox.
+int inbox__retire(Thread *thread, int num) {
+  int count = atomic__add(&thread->inbox_count, -num) - num;
+
+  // Senders increment num_blocked_senders before their last check for space,
+  // and we just made space, so at least one of us sees the other.
+  if (atomic__load(&thread->num_blocked_senders)) {
+    pthread_mutex_lock(&thread->inbox_mutex);
+    pthread_cond_broadcast(&thread->space_signal);
+    pthread_mutex_unlock(&thread->inbox_mutex);
+  }
+
+  return count;
+}
+
+// Moves all announced messages from the inbox into thread->batches.
+static void take_msgs(Thread *thread) {
+  // The caller knows a message has been announced, so a 0 here means the
+  // sender hasn't finished linking it in yet. That takes a few instructions.
+  int num_taken;
+  while ((num_taken = inbox__take_all(thread)) == 0) thread_yield();
+  inbox__retire(thread, num_taken);
+}
+
+// Leaves the eventfd from thready__inbox_fd readable exactly when messages are
+// waiting. Senders only signal it when the inbox becomes nonempty, so the
+// runloops call this before they return. A sender may make the inbox nonempty
+// again right after the clear; it then sees has_event_fd set and signals, or
+// we see its message.
+static void update_event_fd(Thread *thread) {
+  if (!thread->has_event_fd || thread->in_use) return;  // Only outermost.
+  event_fd_clear(thread->event_fd);
+  if (thread->num_batched || atomic__load(&thread->inbox_count)) {
+    event_fd_signal(thread->event_fd);
+  }
+}
+
+// Returns the lane to dispatch from next, or -1 if there's nothing batched.
+// This is normally the highest lane with a batch, including any higher lane
+// whose messages arrived since the batches were taken. To keep busy higher
+// lanes from starving lower ones, every starvation_period-th dispatch goes to
+// the lowest lane with a batch instead.
+static int next_lane(Thread *thread) {
+  int lane = num_lanes - 1;
+  while (lane >= 0 && thread->batches[lane] == NULL) lane--;
+
+  for (int higher = num_lanes - 1; higher > lane; --higher) {
+    int num_taken = take_lane(thread, higher);
+    if (num_taken == 0) continue;
+    // An actor retires its messages after they're dispatched.
+    if (thread->is_actor) {
+      thread->num_taken += num_taken;
+    } else {
+      inbox__retire(thread, num_taken);
+    }
+    lane = higher;
+    break;
+  }
+
+  if (++thread->num_dispatched % starvation_period == 0) {
+    for (int lower = 0; lower < lane; ++lower) {
+      if (thread->batches[lower]) return lower;
+    }
+  }
+  return lane;
+}
+
+// Passes the next envelope to the receiver. The envelope is kept on
+// thread->in_use during the call, as its msg may point into it, and so that
+// thready__exit can release it.
+static void dispatch_one(Thread *thread, thready__Receiver receiver) {
+  int lane = next_lane(thread);
+  Envelope *envelope     = thread->batches[lane];
+  thread->batches[lane]  = envelope->next;
+  thread->num_batched   -= 1;
+  envelope->next = thread->in_use;
+  thread->in_use = envelope;
+
+  trace__event(trace__handler_begin, thread->id, envelope->from, 1,
+               thread->name);
+  if (envelope->from == channel__notice) {
+    // The channel's messages are counted instead of the notice.
+    stat_add(thread, num_received, channel__drain(envelope->msg, receiver));
+  } else if (envelope->from == future__notice) {
+    stat_add(thread, num_received, 1);
+    future__run_callback(envelope->msg);
+  } else {
+    stat_add(thread, num_received, 1);
+    receiver(envelope->msg, envelope->from);
+  }
+  trace__event(trace__handler_end, thread->id, envelope->from, 1, NULL);
+
+  thread->in_use = envelope->next;
+  Future *future = future_of(envelope);
+  if (future) future__complete(future, NULL, thread->id);
+  thready__msg_free(envelope);
+}
+
+// The batch lives in the Thread so that a nested call to thready__runloop from
+// within a receiver continues it in order, and so that thready__exit can
+// release it.
+void thread__dispatch(Thread *thread, thready__Receiver receiver) {
+  // Nested runloops are already timed by the outermost one.
+  int is_outermost = (thread->in_use == NULL);
+  int64_t start = is_outermost ? clock_ns() : 0;
+
+  while (thread->num_batched) dispatch_one(thread, receiver);
+
+  if (is_outermost) stat_add(thread, handler_ns, clock_ns() - start);
+}
+
+// Sleeps until the inbox is nonempty, or until clock_ns() reaches `deadline`.
+// Returns the number of waiting messages, which is 0 after a timeout.
+static int park(Thread *thread, int64_t deadline) {
+  // Blocks we've freed shouldn't sit idle while we sleep.
+  pool__flush_returns();
+
+  int msg_count;
+#if has_futex
+  // Senders check is_waiting after they update inbox_count, and we check
+  // inbox_count after we set is_waiting, so at least one of us sees the other.
+  // A sender clears is_waiting before waking us.
+  while (1) {
+    atomic__store(&thread->is_waiting, 1);
+    if ((msg_count = atomic__load(&thread->inbox_count))) break;
+    if (deadline == no_deadline) {
+      futex_wait(&thread->is_waiting, 1);
+    } else {
+      int64_t timeout_ns = deadline - clock_ns();
+      if (timeout_ns <= 0) break;
+      futex_wait_ns(&thread->is_waiting, 1, timeout_ns);
+    }
+  }
+  atomic__store(&thread->is_waiting, 0);
+#else
+  pthread_mutex_lock(&thread->inbox_mutex);
+  atomic__store(&thread->is_waiting, 1);
+  while ((msg_count = atomic__load(&thread->inbox_count)) == 0) {
+    if (deadline == no_deadline) {
+      pthread_cond_wait(&thread->inbox_signal, &thread->inbox_mutex);
+    } else {
+      int64_t timeout_ns = deadline - clock_ns();
+      if (timeout_ns <= 0) break;
+      pthread_cond_wait_ns(&thread->inbox_signal, &thread->inbox_mutex,
+                           timeout_ns);
+    }
+  }
+  atomic__store(&thread->is_waiting, 0);
+  pthread_mutex_unlock(&thread->inbox_mutex);
+#endif
+  return msg_count;
+}
+
+// Waits until the inbox is nonempty or the deadline passes; returns the number
+// of waiting messages. We first poll the inbox, which is much cheaper than a
+// sleep and wake-up when replies come back within microseconds, and then park.
+static int wait_for_msg(Thread *thread, int64_t deadline) {
+  int msg_count;
+  for (int i = 0; i < thread->spin_budget; ++i) {
+    if ((msg_count = atomic__load_relaxed(&thread->inbox_count))) {
+      return msg_count;
+    }
+    cpu_relax();
+  }
+
+  int64_t park_start = clock_ns();
+  msg_count = park(thread, deadline);
+  int64_t wait_ns = clock_ns() - park_start;
+  stat_add(thread, blocked_ns, wait_ns);
+  if (msg_count == 0) return 0;  // A timeout says nothing about spinning.
+
+  // A message that arrived soon after we parked would likely have been caught
+  // by a longer spin; a message that took a while means spinning was wasted.
+  int budget = thread->spin_budget;
+  if (wait_ns < short_wait_ns) {
+    budget = budget ? 2 * budget : initial_spin_budget;
+  } else {
+    budget /= 2;
+  }
+  if (budget > spin_budget_limit) budget = spin_budget_limit;
+  thread->spin_budget = budget;
+
+  return msg_count;
+}
+
+// Dispatches messages from thread->batches, taking more from the inbox as the
+// batch runs out, until the inbox is empty, `max_msgs` messages have been
+// handled, or clock_ns() reaches `deadline`. A max_msgs of 0 means no limit.
+// Any messages left in the batch are handled by the next runloop call.
+static void dispatch_until(Thread *thread, thready__Receiver receiver,
+                           int max_msgs, int64_t deadline) {
+  int is_outermost = (thread->in_use == NULL);
+  int64_t start = is_outermost ? clock_ns() : 0;
+
+  int num_handled = 0;
+  while (1) {
+    if (thread->num_batched == 0) {
+      if (atomic__load(&thread->inbox_count) == 0) break;
+      take_msgs(thread);
+    }
+
+    dispatch_one(thread, receiver);
+
+    if (++num_handled == max_msgs) break;
+    if (deadline != no_deadline && clock_ns() >= deadline) break;
+  }
+
+  if (is_outermost) stat_add(thread, handler_ns, clock_ns() - start);
+}
+
+// Announces between min_num and max_num more messages for the inbox, as many
+// as it has room for. Sets *num_reserved and returns the previous inbox_count,
+// or returns -1 if the inbox doesn't have room for min_num more messages.
+static int reserve_inbox_slots(Thread *thread, int min_num, int max_num,
+                               int *num_reserved) {
+  if (thread->capacity == 0) {
+    *num_reserved = max_num;
+    return atomic__add(&thread->inbox_count, max_num);
+  }
+
+  int count = atomic__load_relaxed(&thread->inbox_count);
+  int num;
+  do {
+    num = thread->capacity - count;
+    if (num < min_num) return -1;
+    if (num > max_num) num = max_num;
+  } while (!atomic__cas(&thread->inbox_count, &count, count + num));
+  *num_reserved = num;
+  return count;
+}
+
+// Sleeps until the inbox has room, and then reserves up to max_num slots in
+// it. Sets *num_reserved and returns the previous inbox_count, or returns -1
+// if the thread with id `to_id` exits first. The time spent here is counted as
+// blocked time of the sender, `from`.
+static int wait_for_inbox_slots(Thread *from, Thread *thread,
+                                thready__Id to_id, int max_num,
+                                int *num_reserved) {
+  int64_t start = clock_ns();
   pthread_mutex_lock(&thread->inbox_mutex);
-  Envelope *orig_envelope = array__item_ptr(thread->inbox, 0);
-  // Make a copy as we're about to delete the original.
-  Envelope envelope = *orig_envelope;
-  array__remove_item(thread->inbox, orig_envelope);
+  atomic__add(&thread->num_blocked_senders, 1);
+  int prev_count;
+  while ((prev_count = reserve_inbox_slots(thread, 1, max_num,
+                                           num_reserved)) == -1) {
+    // thread__release changes the generation before it signals.
+    if (is_stale(thread, to_id)) break;
+    pthread_cond_wait(&thread->space_signal, &thread->inbox_mutex);
+  }
+  atomic__add(&thread->num_blocked_senders, -1);
   pthread_mutex_unlock(&thread->inbox_mutex);
+  stat_add(from, blocked_ns, clock_ns() - start);
+  return prev_count;
+}
+
+// Wakes up the owner of `thread` if it may be sleeping on an empty inbox that
+// just received its first message, or schedules it if it's an actor. Senders
+// call this after inbox_push.
+static void wake_receiver(Thread *thread, int prev_count) {
+  if (prev_count != 0) return;
+  if (thread->is_actor) {
+    scheduler__make_ready(thread);
+    return;
+  }
+  if (atomic__load(&thread->has_event_fd)) event_fd_signal(thread->event_fd);
+  if (atomic__load(&thread->is_waiting)) {
+#if has_futex
+    if (atomic__swap(&thread->is_waiting, 0)) futex_wake(&thread->is_waiting);
+#else
+    pthread_mutex_lock(&thread->inbox_mutex);
+    pthread_cond_signal(&thread->inbox_signal);
+    pthread_mutex_unlock(&thread->inbox_mutex);
+#endif
+  }
+}
+
+// Returns a new envelope for `msg`, or NULL if we're out of memory. If
+// `copy_len` is nonzero, `msg` points to that many bytes, which are copied
+// into the envelope from its future field on, in the same block; a copy of up
+// to 24 bytes fits in a cache line along with the envelope.
+static Envelope *new_envelope(void *msg, size_t copy_len, thready__Id from,
+                              Future *future) {
+  size_t size = copy_len ? offsetof(Envelope, future) + copy_len :
+                           sizeof(Envelope);
+  Envelope *envelope = thready__msg_alloc(size);
+  if (envelope == NULL) return NULL;
+  if (copy_len) {
+    msg = memcpy(&envelope->future, msg, copy_len);
+  } else {
+    envelope->future = future;
+  }
+  envelope->msg  = msg;
+  envelope->from = from;
+  return envelope;
+}
+
+// Frees a NULL-terminated chain of envelopes that were never sent.
+static void free_envelope_chain(Envelope *envelope) {
+  while (envelope) {
+    Envelope *next = envelope->next;
+    thready__msg_free(envelope);
+    envelope = next;
+  }
+}
+
+// Returns the Thread with id `to_id` and counts the caller as one of its
+// senders, or returns NULL if the id is stale or invalid. The caller must call
+// leave_inbox when it's done sending. Until then, the thread may exit, but its
+// slot won't be emptied or reused, so a message pushed in the meantime is
+// either received or freed along with the inbox.
+static Thread *enter_inbox(thready__Id to_id) {
+  Thread *to = slot_of(to_id);
+  if (to == NULL) return NULL;
+  atomic__add(&to->num_senders, 1);
+  // thread__release changes the generation before it reads num_senders, and
+  // we did the reverse, so at least one of us sees the other.
+  if (is_stale(to, to_id)) {
+    atomic__add(&to->num_senders, -1);
+    return NULL;
+  }
+  return to;
+}
+
+static void leave_inbox(Thread *to) {
+  atomic__add(&to->num_senders, -1);
+}
+
+// This is the implementation behind thready__send and its variants. If
+// `copy_len` is nonzero, `msg` points to that many bytes, which are copied into
+// the envelope; the receiver gets a pointer to the copy. The message goes into
+// the given lane of the inbox of `to`, and carries `future`, if it's not NULL,
+// for the reply. If that inbox is full, this waits for room when `blocking` is
+// set, and otherwise returns thready__full. Ids of exited threads get
+// thready__error, as does running out of memory.
+static thready__Id send_from(Thread *from, void *msg, size_t copy_len,
+                             thready__Id to_id, int lane, int blocking,
+                             Future *future) {
+  if (from == NULL) return thready__error;
+
+  // We make the envelope before reserving room for it. Giving a reservation
+  // back could hide another sender's message from a sleeping receiver, since
+  // only the sender that takes inbox_count from 0 to 1 wakes it.
+  Envelope *envelope = new_envelope(msg, copy_len, from->id, future);
+  if (envelope == NULL) return thready__error;
+  Thread *to = enter_inbox(to_id);
+  if (to == NULL) {
+    thready__msg_free(envelope);
+    return thready__error;
+  }
+  trace__event(trace__send, from->id, to_id, 1, NULL);
+
+  int num_reserved;
+  int prev_count = reserve_inbox_slots(to, 1, 1, &num_reserved);
+  if (prev_count == -1) {
+    // A thread can't wait for itself to make room.
+    thready__Id result = thready__full;
+    if (blocking && to != from) {
+      prev_count = wait_for_inbox_slots(from, to, to_id, 1, &num_reserved);
+      result     = thready__error;
+    }
+    if (prev_count == -1) {
+      leave_inbox(to);
+      thready__msg_free(envelope);
+      return result;
+    }
+  }
+
+  stat_add(from, num_sent, 1);
+  inbox_push(to, lane, envelope, envelope);
+  trace__event(trace__enqueue, from->id, to_id, 1, NULL);
+  wake_receiver(to, prev_count);
+  leave_inbox(to);
+
+  return thready__success;
+}
+
+thready__Id inbox__force_send(thready__Id to_id, void *msg, size_t copy_len,
+                              thready__Id from) {
+  Envelope *envelope = new_envelope(msg, copy_len, from, NULL);
+  if (envelope == NULL) return thready__error;
+  Thread *to = enter_inbox(to_id);
+  if (to == NULL) {
+    thready__msg_free(envelope);
+    return thready__error;
+  }
 
-  receiver(envelope.msg, envelope.from);
+  int prev_count = atomic__add(&to->inbox_count, 1);
+  inbox_push(to, thready__priority_normal, envelope, envelope);
+  trace__event(trace__enqueue, from, to_id, 1, NULL);
+  wake_receiver(to, prev_count);
+  leave_inbox(to);
+
+  return thready__success;
+}
+
+// This is the implementation behind thready__send_many. Messages are pushed in
+// as few linked chains as the inbox capacity allows; an unbounded inbox takes
+// them all with one reservation, one push and at most one wakeup. As in
+// send_from, the envelopes are made before any room is reserved.
+static thready__Id send_many_from(Thread *from, void **msgs, int count,
+                                  thready__Id to_id) {
+  if (from == NULL) return thready__error;
+
+  Envelope *first = NULL, *last = NULL;
+  for (int i = 0; i < count; ++i) {
+    Envelope *envelope = new_envelope(msgs[i], 0, from->id, NULL);
+    if (envelope == NULL) {
+      if (last) last->next = NULL;
+      free_envelope_chain(first);
+      return thready__error;
+    }
+    if (last) last->next = envelope; else first = envelope;
+    last = envelope;
+  }
+  if (last) last->next = NULL;
+
+  Thread *to = enter_inbox(to_id);
+  if (to == NULL) {
+    free_envelope_chain(first);
+    return thready__error;
+  }
+  trace__event(trace__send, from->id, to_id, count, NULL);
+
+  while (count > 0) {
+    // A thread can't wait for itself to make room, so it sends all or nothing.
+    int min_num = (to == from) ? count : 1;
+    int num_reserved;
+    int prev_count = reserve_inbox_slots(to, min_num, count, &num_reserved);
+    if (prev_count == -1) {
+      thready__Id result = thready__full;
+      if (to != from) {
+        prev_count = wait_for_inbox_slots(from, to, to_id, count,
+                                          &num_reserved);
+        result     = thready__error;
+      }
+      if (prev_count == -1) {
+        leave_inbox(to);
+        free_envelope_chain(first);
+        return result;
+      }
+    }
+
+    Envelope *chunk_last = first;
+    for (int i = 1; i < num_reserved; ++i) chunk_last = chunk_last->next;
+    Envelope *rest = chunk_last->next;
+    stat_add(from, num_sent, num_reserved);
+    inbox_push(to, thready__priority_normal, first, chunk_last);
+    trace__event(trace__enqueue, from->id, to_id, num_reserved, NULL);
+    wake_receiver(to, prev_count);
+
+    first  = rest;
+    count -= num_reserved;
+  }
+
+  leave_inbox(to);
+  return thready__success;
+}
+
+// thready__send_scatter sorts these to group messages by recipient.
+typedef struct {
+  thready__Id  to;
+  int          index;  // Into msgs, to keep each group in order.
+} ScatterItem;
+
+static int compare_scatter_items(const void *a_vp, const void *b_vp) {
+  const ScatterItem *a = a_vp;
+  const ScatterItem *b = b_vp;
+  if (a->to != b->to) return (uintptr_t)a->to < (uintptr_t)b->to ? -1 : 1;
+  return a->index - b->index;
 }
 
 
@@ -114,36 +884,78 @@ static void send_out_first_msg(Thread *thread, thready__Receiver receiver) {
 
 const thready__Id thready__error   = NULL;
 const thready__Id thready__success = (thready__Id) 0x1;
+const thready__Id thready__full    = (thready__Id) 0x2;
+
+// Like the constants above, these have a generation of 0, so they're never the
+// id of a thread. 0x4 and 0x6 are internal senders; see internal.h.
+const thready__Id thready__reactor       = (thready__Id) 0x3;
+const thready__Id thready__end_of_stream = (thready__Id) 0x5;
 
 
 // Public functions.
 
 thready__Id thready__create(thready__Receiver receiver) {
+  return thready__create_bounded(receiver, 0);  // 0 --> unbounded inbox
+}
+
+thready__Id thready__create_bounded(thready__Receiver receiver, int capacity) {
+  thready__Attrs attrs = { .capacity = capacity };
+  return thready__create_with_attrs(receiver, &attrs);
+}
+
+thready__Id thready__create_with_attrs(thready__Receiver receiver,
+                                       const thready__Attrs *attrs) {
   pthread_once(&init_control, init);
 
-  // Write-lock `threads` now so the new thread doesn't read from it before
-  // we write to it.
-  pthread_rwlock_wrlock(&threads_lock);
+  thready__Attrs defaults = { 0 };
+  if (attrs == NULL) attrs = &defaults;
+  if (attrs->capacity < 0 || attrs->num_cpus < 0 ||
+      attrs->sched_policy < 0 || attrs->sched_policy > thready__sched_rr) {
+    return thready__error;
+  }
+
+#ifdef _WIN32
+  void *pthread_attr = NULL;  // Our windows wrapper ignores attributes.
+#else
+  pthread_attr_t attr_storage;
+  pthread_attr_t *pthread_attr = &attr_storage;
+  if (!init_pthread_attr(pthread_attr, attrs)) {
+    pthread_attr_destroy(pthread_attr);
+    return thready__error;
+  }
+#endif
+
+  // Allocate the new thread's inbox. The new thread receives this directly.
+  Thread *thread   = new_thread_struct();
+  if (thread == NULL) {
+#ifndef _WIN32
+    pthread_attr_destroy(pthread_attr);
+#endif
+    return thready__error;
+  }
+  thread->receiver = receiver;
+  thread->capacity = attrs->capacity;
+  if (attrs->name) {
+    strncpy(thread->name, attrs->name, sizeof(thread->name) - 1);
+  }
+
+  // The new thread may exit, and free its slot, before pthread_create returns.
+  thready__Id id = thread->id;
 
   pthread_t pthread;
   int err = pthread_create(&pthread,       // receive thread id
-                           NULL,           // NULL --> use default attributes
+                           pthread_attr,   // stack size, cpus, etc.
                            thread_runner,  // init function
-                           receiver);      // init function arg
+                           thread);        // init function arg
+#ifndef _WIN32
+  pthread_attr_destroy(pthread_attr);
+#endif
   if (err) {
-    pthread_rwlock_wrunlock(&threads_lock);
+    thread__release(thread);
     return thready__error;
   }
 
-  // Allocate and set the new thread's inbox.
-  Thread *thread = new_thread_struct();
-
-  // threads[pthread] = thread
-  map__set(threads, (void *)(intptr_t)pthread, thread);
-
-  pthread_rwlock_wrunlock(&threads_lock);
-
-  return (thready__Id)thread;
+  return id;
 }
 
 thready__Id thready__create_once(thready__Receiver receiver) {
@@ -174,69 +986,262 @@ thready__Id thready__create_once(thready__Receiver receiver) {
   return thread;
 }
 
+thready__Id thready__spawn(thready__Receiver receiver) {
+  pthread_once(&init_control, init);
+  if (scheduler__start() == thready__error) return thready__error;
+  Thread *actor   = new_thread_struct();
+  if (actor == NULL) return thready__error;
+  actor->receiver = receiver;
+  actor->is_actor = 1;
+  return actor->id;
+}
+
+thready__Id thready__spawn_coroutine(thready__Receiver receiver) {
+  thready__Id id = thready__spawn(receiver);
+  Thread *actor  = thread__of(id);
+  if (actor) actor->is_coroutine = 1;  // Nobody else has the id yet.
+  return id;
+}
+
 void thready__exit() {
-  pthread_rwlock_wrlock(&threads_lock);
-  map__unset(threads, (void *)(intptr_t)pthread_self());
-  pthread_rwlock_wrunlock(&threads_lock);
+  if (current_thread && current_thread->is_actor) scheduler__exit_actor();
+
+  if (current_thread) thread__release(current_thread);
+  current_thread = NULL;
+  pool__release();
+  trace__release();
   pthread_exit(NULL);  // NULL -> Unused return value to pthread_join.
 }
 
 thready__Id thready__runloop(thready__Receiver receiver, int blocking) {
-  pthread_once(&init_control, init);
-
   // Get this thread's Thread object.
-  Thread *thread = (Thread *)thready__my_id();
-  if (thread == thready__error) return thready__error;
+  Thread *thread = thread__current();
+  if (thread == NULL) return thready__error;
 
-  // Check if the inbox has messages.
-  pthread_mutex_lock(&thread->inbox_mutex);
-  int msg_count = thread->inbox->count;
+  // Actors receive their messages from the scheduler.
+  if (thread->is_actor) return thready__error;
+
+  // If an outer call to runloop is mid-batch, we finish that batch first.
+  if (thread->num_batched == 0) {
+    // Check if the inbox has messages.
+    int msg_count = atomic__load(&thread->inbox_count);
+
+    // If the inbox is empty and this call is blocking, wait for a message.
+    if (blocking && msg_count == 0) {
+      msg_count = wait_for_msg(thread, no_deadline);
+    }
 
-  // If the inbox is empty and this call is blocking, wait for a message.
-  if (blocking && msg_count == 0) {
-    pthread_cond_wait(&thread->inbox_signal, &thread->inbox_mutex);
-    msg_count = thread->inbox->count;
+    if (msg_count) take_msgs(thread);
   }
 
-  pthread_mutex_unlock(&thread->inbox_mutex);
+  thread__dispatch(thread, receiver);
+  update_event_fd(thread);
 
-  for (int i = 0; i < msg_count; ++i) send_out_first_msg(thread, receiver);
+  // A caller polling with nonblocking runloops may never park, so we hand
+  // back the blocks it freed here instead.
+  if (!blocking) pool__flush_returns();
 
-  return thread;
+  return thread->id;
 }
 
-thready__Id thready__send(void *msg, thready__Id to_id) {
+thready__Id thready__runloop_until(thready__Receiver receiver,
+                                   int64_t deadline_ns) {
+  Thread *thread = thread__current();
+  if (thread == NULL || thread->is_actor) return thready__error;
+
+  while (clock_ns() < deadline_ns) {
+    if (thread->num_batched == 0 && atomic__load(&thread->inbox_count) == 0 &&
+        wait_for_msg(thread, deadline_ns) == 0) {
+      break;
+    }
+    dispatch_until(thread, receiver, 0, deadline_ns);
+  }
+  update_event_fd(thread);
+  pool__flush_returns();
+
+  return thread->id;
+}
+
+thready__Id thready__runloop_budget(thready__Receiver receiver, int max_msgs,
+                                    int64_t max_ns) {
+  Thread *thread = thread__current();
+  if (thread == NULL || thread->is_actor) return thready__error;
+  if (max_msgs < 0 || max_ns < 0) return thready__error;
+
+  int64_t deadline = max_ns ? clock_ns() + max_ns : no_deadline;
+  dispatch_until(thread, receiver, max_msgs, deadline);
+  update_event_fd(thread);
+  pool__flush_returns();
+
+  return thread->id;
+}
+
+// Fills in `stats` from `thread`. Slots are never freed, so this is safe even
+// if the thread exits during the call; the numbers are then its last ones.
+static void copy_stats(Thread *thread, thready__Stats *stats) {
+  stats->id = thread->id;
+  memcpy(stats->name, thread->name, sizeof(stats->name));
+  stats->num_sent        = atomic__load_relaxed(&thread->num_sent);
+  stats->num_received    = atomic__load_relaxed(&thread->num_received);
+  stats->inbox_depth     = atomic__load_relaxed(&thread->inbox_count) -
+                           atomic__load_relaxed(&thread->num_taken) +
+                           atomic__load_relaxed(&thread->num_batched);
+  stats->max_inbox_depth = atomic__load_relaxed(&thread->max_inbox_depth);
+  stats->blocked_ns      = atomic__load_relaxed(&thread->blocked_ns);
+  stats->handler_ns      = atomic__load_relaxed(&thread->handler_ns);
+  if (stats->max_inbox_depth < stats->inbox_depth) {
+    stats->max_inbox_depth = stats->inbox_depth;
+  }
+}
+
+int thready__stats(thready__Stats *stats, int max_stats) {
   pthread_once(&init_control, init);
 
-  // Get this thread's Thread object.
-  Thread *from = (Thread *)thready__my_id();
-  if (from == thready__error) { return thready__error; }
+  // Holding this lock keeps new threads from taking slots while we read them.
+  pthread_mutex_lock(&slots_mutex);
+  int num_threads = 0;
+  for (uintptr_t index = 0; index < num_slots; ++index) {
+    Thread *thread = chunks[index / slots_per_chunk] + index % slots_per_chunk;
+    if (!thread->is_live || thread->is_actor) continue;
+    if (num_threads < max_stats) copy_stats(thread, stats + num_threads);
+    num_threads++;
+  }
+  pthread_mutex_unlock(&slots_mutex);
 
-  Thread *to = (Thread *)to_id;
+  return num_threads;
+}
+
+thready__Id thready__thread_stats(thready__Id id, thready__Stats *stats) {
+  Thread *thread = thread__of(id);
+  if (thread == NULL || stats == NULL) return thready__error;
+  copy_stats(thread, stats);
+  return thready__success;
+}
+
+int64_t thready__now_ns() {
+  return clock_ns();
+}
+
+thready__Id thready__send(void *msg, thready__Id to_id) {
+  return send_from(thread__current(), msg, 0, to_id,
+                   thready__priority_normal, 1, NULL);
+}
+
+thready__Id thready__try_send(void *msg, thready__Id to_id) {
+  return send_from(thread__current(), msg, 0, to_id,
+                   thready__priority_normal, 0, NULL);
+}
+
+thready__Id thready__send_copy(const void *bytes, size_t len,
+                               thready__Id to_id) {
+  void *msg = len ? (void *)bytes : NULL;
+  return send_from(thread__current(), msg, len, to_id,
+                   thready__priority_normal, 1, NULL);
+}
+
+thready__Id thready__send_priority(void *msg, thready__Id to_id,
+                                   int priority) {
+  if (priority < 0 || priority >= num_lanes) return thready__error;
+  return send_from(thread__current(), msg, 0, to_id, priority, 1,
+                   NULL);
+}
+
+thready__Future *thready__call(void *msg, thready__Id to_id) {
+  Future *future = future__new();
+  if (future == NULL) return NULL;
+  if (send_from(thread__current(), msg, 0, to_id,
+                thready__priority_normal, 1, future) != thready__success) {
+    // Sends only fail before the envelope is queued, so nobody else has seen
+    // the future.
+    thready__msg_free(future);
+    return NULL;
+  }
+  return future;
+}
 
-  pthread_mutex_lock(&to->inbox_mutex);
-  array__new_val(to->inbox, Envelope) = (Envelope){ .msg = msg, .from = from };
-  // If the inbox used to be empty, let any possibly-waiting threads know it
-  // has a message.
-  if (to->inbox->count == 1) pthread_cond_signal(&to->inbox_signal);
-  pthread_mutex_unlock(&to->inbox_mutex);
+thready__Id thready__reply(void *reply) {
+  // The innermost message being received is the one we're replying to.
+  Thread *thread = current_thread;
+  if (thread == NULL || thread->in_use == NULL) return thready__error;
+  Future *future = future_of(thread->in_use);
+  if (future == NULL) return thready__error;
 
+  thread->in_use->future = NULL;
+  future__complete(future, reply, thread->id);
   return thready__success;
 }
 
-thready__Id thready__my_id() {
-  pthread_once(&init_control, init);
+thready__Id thready__send_many(void **msgs, int count, thready__Id to_id) {
+  return send_many_from(thread__current(), msgs, count, to_id);
+}
+
+thready__Id thready__send_scatter(void **msgs, thready__Id *to_ids, int count) {
+  Thread *from = thread__current();
+  if (from == NULL || count < 0) return thready__error;
+
+  // The common case of a single recipient is sent without grouping.
+  int i = 1;
+  while (i < count && to_ids[i] == to_ids[0]) ++i;
+  if (i >= count) {
+    return count ? send_many_from(from, msgs, count, to_ids[0])
+                 : thready__success;
+  }
+
+  // Group the messages by recipient, keeping their order within each group.
+  ScatterItem *items  = malloc(count * sizeof(ScatterItem));
+  void **      sorted = malloc(count * sizeof(void *));
+  if (items == NULL || sorted == NULL) {
+    free(items);
+    free(sorted);
+    return thready__error;
+  }
+  for (i = 0; i < count; ++i) {
+    items[i].to    = to_ids[i];
+    items[i].index = i;
+  }
+  qsort(items, count, sizeof(ScatterItem), compare_scatter_items);
+  for (i = 0; i < count; ++i) sorted[i] = msgs[items[i].index];
 
-  pthread_rwlock_rdlock(&threads_lock);
-  map__key_value *pair = map__get(threads, (void *)(intptr_t)pthread_self());
-  pthread_rwlock_rdunlock(&threads_lock);
+  // A stale id fails the whole call before anything is sent.
+  int is_valid = 1;
+  for (i = 0; i < count; ++i) {
+    if (i && items[i].to == items[i - 1].to) continue;
+    if (thread__of(items[i].to) == NULL) is_valid = 0;
+  }
 
-  if (pair == NULL) {
-    pthread_rwlock_wrlock(&threads_lock);
-    Thread *thread = new_thread_struct();
-    pair = map__set(threads, (void *)(intptr_t)pthread_self(), thread);
-    pthread_rwlock_wrunlock(&threads_lock);
+  thready__Id result = is_valid ? thready__success : thready__error;
+  for (int start = 0; is_valid && start < count;) {
+    int end = start + 1;
+    while (end < count && items[end].to == items[start].to) ++end;
+    thready__Id group_result = send_many_from(from, sorted + start,
+                                              end - start, items[start].to);
+    if (group_result != thready__success) result = group_result;
+    start = end;
   }
+  free(items);
+  free(sorted);
+
+  return result;
+}
+
+int thready__inbox_fd() {
+  Thread *thread = thread__current();
+  if (thread == NULL || thread->is_actor) return -1;
+  if (thread->has_event_fd) return thread->event_fd;
 
-  return (thready__Id)pair->value;
+  if (thread->event_fd == -1) thread->event_fd = event_fd_new();
+  if (thread->event_fd == -1) return -1;
+  event_fd_clear(thread->event_fd);  // A past owner of the slot may have left
+                                     // it readable.
+
+  // Senders that saw has_event_fd as 0 didn't signal, so we check for their
+  // messages after we set it.
+  atomic__store(&thread->has_event_fd, 1);
+  if (atomic__load(&thread->inbox_count)) event_fd_signal(thread->event_fd);
+  return thread->event_fd;
+}
+
+thready__Id thready__my_id() {
+  Thread *thread = thread__current();
+  return thread ? thread->id : thready__error;
 }
@@ -12,6 +12,9 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 
 // Typedefs.
 
@@ -20,23 +23,216 @@ typedef void *thready__Id;  // An identifier for a thread.
 // A function to receive messages.
 typedef void  (*thready__Receiver)(void *msg, thready__Id from);
 
+// A snapshot of one thread's messaging statistics.
+typedef struct {
+  thready__Id id;
+  char        name[16];         // From thready__Attrs; empty if unnamed.
+  uint64_t    num_sent;         // Messages sent by this thread.
+  uint64_t    num_received;     // Messages this thread's receivers have run.
+  int         inbox_depth;      // Messages waiting to be received.
+  int         max_inbox_depth;  // The most ever seen waiting at once.
+  int64_t     blocked_ns;       // Time waiting for messages or inbox room.
+  int64_t     handler_ns;       // Time spent in receivers.
+} thready__Stats;
+
+// Options for thready__create_with_attrs. Zeroed fields get default behavior.
+typedef struct {
+  int          capacity;        // Inbox capacity; 0 means unbounded.
+  size_t       stack_size;      // In bytes; 0 means the system default.
+  const char * name;            // Shown by debuggers and tools such as top.
+  const int *  cpus;            // The cpus this thread may run on (linux
+  int          num_cpus;        // only); num_cpus == 0 means any cpu.
+  int          sched_policy;    // One of the thready__sched_* constants.
+  int          sched_priority;  // For thready__sched_fifo or _rr.
+} thready__Attrs;
+
+// A pending reply to a message sent with thready__call.
+typedef struct thready__Future thready__Future;
+
+// A set of subscribers that each get every message published to the topic.
+typedef struct thready__Topic thready__Topic;
+
+// A bounded queue from one producer to one receiving thread or actor.
+typedef struct thready__Channel thready__Channel;
+
+// A chain of stages, each run by its own threads, that items pass through.
+typedef struct thready__Pipeline thready__Pipeline;
+
+// The message sent by thready__reactor when a watched fd is ready.
+typedef struct {
+  int fd;
+  int events;                   // thready__fd_* bits.
+} thready__FdEvent;
+
+typedef uint64_t thready__Timer;  // An identifier for a pending timer; 0 is
+                                  // never a valid timer.
+
 
 // The thready interface.
 
-thready__Id thready__create      (thready__Receiver receiver);
-thready__Id thready__create_once (thready__Receiver receiver);
-void        thready__exit        ();
+thready__Id thready__create         (thready__Receiver receiver);
+thready__Id thready__create_bounded (thready__Receiver receiver, int capacity);
+thready__Id thready__create_once    (thready__Receiver receiver);
+thready__Id thready__create_with_attrs(thready__Receiver receiver,
+                                       const thready__Attrs *attrs);
+void        thready__exit           ();
+
+// Actors have an inbox and a receiver but no OS thread of their own; they are
+// run by a shared pool of worker threads.
+thready__Id thready__spawn          (thready__Receiver receiver);
+thready__Id thready__set_num_workers(int num_workers);  // Before any spawns.
+thready__Id thready__set_scheduling (int policy);       // Before any spawns.
+
+// Coroutine actors run their receivers on stacks of their own, so that a
+// receiver can wait for a reply with thready__await_reply while its worker
+// runs other actors. Elsewhere, thready__await_reply blocks until the reply.
+thready__Id thready__spawn_coroutine(thready__Receiver receiver);
+thready__Id thready__await_reply    (thready__Future *future, void **reply);
+
+thready__Id thready__runloop (thready__Receiver receiver, int blocking);
+
+// Bounded runloops. Deadlines are in thready__now_ns() time; a limit of 0 means
+// no limit.
+thready__Id thready__runloop_until (thready__Receiver receiver,
+                                    int64_t deadline_ns);
+thready__Id thready__runloop_budget(thready__Receiver receiver, int max_msgs,
+                                    int64_t max_ns);
+int64_t     thready__now_ns        ();
+
+// Returns an fd, for poll or epoll, that's readable while the calling thread's
+// inbox is nonempty; or -1 for actors and on systems without eventfds.
+int         thready__inbox_fd      ();
+
+thready__Id thready__send     (void *msg, thready__Id to);
+thready__Id thready__try_send (void *msg, thready__Id to);
+thready__Id thready__send_copy(const void *bytes, size_t len, thready__Id to);
+thready__Id thready__send_priority(void *msg, thready__Id to, int priority);
+thready__Id thready__my_id    ();
 
-thready__Id thready__runloop(thready__Receiver receiver, int blocking);
-thready__Id thready__send   (void *msg, thready__Id to);
-thready__Id thready__my_id  ();
+// Request/reply. A receiver answers a message from thready__call by calling
+// thready__reply; the caller gets the reply from the returned future with
+// exactly one of thready__future_wait, thready__future_then or
+// thready__future_cancel. A negative timeout_ns waits without limit.
+thready__Future *thready__call       (void *msg, thready__Id to);
+thready__Id      thready__reply      (void *reply);
+thready__Id      thready__future_wait(thready__Future *future,
+                                      int64_t timeout_ns, void **reply);
+thready__Id      thready__future_then(thready__Future *future,
+                                      thready__Receiver callback);
+void             thready__future_cancel(thready__Future *future);
+
+// Publish/subscribe. A topic delivers each shared payload to all of its
+// subscribers without copying it; every receiver of a shared payload must
+// release it. thready__topic_publish returns the number of subscribers sent to.
+thready__Topic *thready__topic_new        ();
+void            thready__topic_delete     (thready__Topic *topic);
+thready__Id     thready__topic_subscribe  (thready__Topic *topic,
+                                           thready__Id id);
+thready__Id     thready__topic_unsubscribe(thready__Topic *topic,
+                                           thready__Id id);
+int             thready__topic_publish    (thready__Topic *topic, void *shared);
+
+// Reference-counted payloads; thready__shared_alloc returns one reference.
+void *thready__shared_alloc  (size_t size);
+void  thready__shared_retain (void *shared);
+void  thready__shared_release(void *shared);
+
+// Batched sends: msgs[i] goes to `to`, or to to_ids[i] for the scatter version.
+// A scatter with a stale id sends nothing, but a recipient that exits, or a
+// group that doesn't fit our own bounded inbox, fails after the other groups
+// may have been sent.
+thready__Id thready__send_many   (void **msgs, int count, thready__Id to);
+thready__Id thready__send_scatter(void **msgs, thready__Id *to_ids, int count);
+
+// Single-producer channels. Messages sent on a channel are received by `to`,
+// in order, from the sending thread; only one thread may send at a time. The
+// send functions block while the channel is full, and
+// thready__channel_try_send returns thready__full instead.
+thready__Channel *thready__channel_new      (int capacity, thready__Id to);
+void              thready__channel_delete   (thready__Channel *channel);
+thready__Id       thready__channel_send     (thready__Channel *channel,
+                                             void *msg);
+thready__Id       thready__channel_try_send (thready__Channel *channel,
+                                             void *msg);
+thready__Id       thready__channel_send_many(thready__Channel *channel,
+                                             void **msgs, int count);
+
+// Pipelines. Items pushed into a pipeline go through its stages in order; each
+// stage's receiver runs on `parallelism` threads and passes items on with
+// thready__pipeline_emit. Closing the pipeline ends its stream: each stage's
+// receiver gets a NULL item from thready__end_of_stream, and then `to`
+// receives the pipeline from thready__end_of_stream.
+thready__Pipeline *thready__pipeline_new      (int batch_size, int capacity,
+                                               thready__Id to);
+thready__Id        thready__pipeline_delete   (thready__Pipeline *pipeline);
+thready__Id        thready__pipeline_add_stage(thready__Pipeline *pipeline,
+                                               thready__Receiver receiver,
+                                               int parallelism);
+thready__Id        thready__pipeline_push     (thready__Pipeline *pipeline,
+                                               void *item);
+thready__Id        thready__pipeline_close    (thready__Pipeline *pipeline);
+thready__Id        thready__pipeline_emit     (void *item);
+
+// Timers send a message after a delay, or repeatedly; these return 0 on error.
+thready__Timer thready__send_after  (void *msg, thready__Id to, int64_t delay_ns);
+thready__Timer thready__send_every  (void *msg, thready__Id to, int64_t period_ns);
+thready__Id    thready__cancel_timer(thready__Timer timer);
+
+// I/O readiness (linux only). When a watched fd is ready, `to` receives a
+// thready__FdEvent from thready__reactor; the watch is then disarmed until the
+// fd is watched again.
+thready__Id thready__watch_fd  (int fd, int events, thready__Id to);
+thready__Id thready__unwatch_fd(int fd);
+
+// Statistics. thready__stats fills in up to max_stats entries, one per live OS
+// thread that uses thready, and returns the number of such threads.
+int         thready__stats       (thready__Stats *stats, int max_stats);
+thready__Id thready__thread_stats(thready__Id id, thready__Stats *stats);
+
+// Tracing. Each OS thread keeps its latest num_events events, or a default
+// number if num_events is 0; thready__trace_write saves them as chrome trace
+// json.
+thready__Id thready__trace_start(int num_events);
+void        thready__trace_stop ();
+thready__Id thready__trace_write(const char *path);
+
+// A fast allocator for messages; any thread may free a message from any other.
+void *thready__msg_alloc(size_t size);
+void  thready__msg_free (void *msg);
 
 
 // Constants
 
 extern const thready__Id thready__error;
 extern const thready__Id thready__success;
+extern const thready__Id thready__full;  // From thready__try_send.
+extern const thready__Id thready__reactor;  // The sender of fd events.
+extern const thready__Id thready__end_of_stream;  // From pipelines.
 
 // Use these constants with thready__runloop for readable parameter values.
 #define thready__nonblocking 0
 #define thready__blocking    1
+
+// Use these constants with thready__send_priority. Higher priorities are
+// received first; thready__send uses thready__priority_normal.
+#define thready__priority_low    0
+#define thready__priority_normal 1
+#define thready__priority_high   2
+#define thready__priority_urgent 3
+#define thready__num_priorities  4
+
+// Use these constants for thready__Attrs.sched_policy. The real-time policies
+// usually need extra privileges.
+#define thready__sched_default 0  // Inherit the creating thread's policy.
+#define thready__sched_other   1
+#define thready__sched_fifo    2
+#define thready__sched_rr      3
+
+// Use these constants with thready__watch_fd and in thready__FdEvent.events.
+#define thready__fd_read   1
+#define thready__fd_write  2
+#define thready__fd_hangup 4  // Only in events: a hangup or error on the fd.
+
+// Use these constants with thready__set_scheduling.
+#define thready__work_stealing 0
+#define thready__shared_queue  1
@@ -0,0 +1,300 @@
+// timer.c
+//
+// https://github.com/tylerneylon/thready
+//
+// Delivers messages in the future for thready__send_after and
+// thready__send_every.
+//
+// Pending timers live in a hierarchical timing wheel in the style of the
+// classic Linux kernel timers: num_levels wheels of slots_per_level slots
+// each. Level 0 has one slot per tick; each slot of level n covers a whole
+// turn of level n - 1. A timer goes into the lowest level whose range covers
+// its expiration, so that adding or cancelling a timer is O(1). Each time a
+// level's index wraps around to 0, the timers in the next slot of the level
+// above are cascaded down into finer slots.
+//
+// A single internal thread runs the wheel. It sleeps until the next tick that
+// might have work to do, and sends each expired timer's message with the
+// sending thread as its `from` value. Those sends ignore inbox capacity so
+// that the timer thread never blocks. A timer whose recipient has exited is
+// dropped when it fires, even if it's periodic.
+//
+// Timer handles pack a slot index and a generation count, so a stale handle
+// for a timer that has fired, or been cancelled, is recognized as such.
+//
+
+#include "internal.h"
+
+#include <stdlib.h>
+
+
+// Internal types.
+
+#define tick_ns         1000000  // 1 ms.
+#define level_bits      6
+#define slots_per_level (1 << level_bits)
+#define slot_mask       (slots_per_level - 1)
+#define num_levels      6
+
+// Longer delays are shortened to this, which is over two years.
+#define max_ticks (((int64_t)1 << (level_bits * num_levels)) - 1)
+#define max_delay_ns (max_ticks * tick_ns)
+
+#define timers_per_chunk 1024
+#define max_chunks       65536
+
+typedef struct Timer {
+  struct Timer *  next;       // The next timer in the slot, or in free_list.
+  struct Timer ** prev_next;  // Whatever points to this timer in its slot.
+  int64_t         expires;    // In ticks.
+  int64_t         period;     // In ticks; 0 for timers that fire once.
+  void *          msg;
+  thready__Id     from;
+  thready__Id     to;
+  uint32_t        index;      // Where this timer lives in `chunks`.
+  uint32_t        generation; // Incremented each time this timer is freed.
+  int             is_pending; // Set from alloc_timer until free_timer.
+} Timer;
+
+
+// Internal data.
+
+// All of these are guarded by timer_mutex.
+
+static Timer *          wheel[num_levels][slots_per_level];
+static int64_t          timer_tick  = 0;  // The next tick to run.
+static int64_t          wake_tick   = 0;  // When the timer thread will wake.
+static int              num_pending = 0;
+
+// Timers are allocated in chunks that never move or get freed, so that a
+// timer's address is stable and handles can be checked in O(1).
+static Timer *          chunks[max_chunks];
+static int              num_chunks  = 0;
+static Timer *          free_list   = NULL;
+
+static int64_t          start_ns;  // Tick 0.
+static int              timer_is_running = 0;
+
+static pthread_mutex_t  timer_mutex  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   timer_signal = PTHREAD_COND_INITIALIZER;
+
+
+// Internal functions.
+
+static int64_t current_tick() {
+  return (clock_ns() - start_ns) / tick_ns;
+}
+
+static void link_timer(Timer *timer, Timer **slot) {
+  timer->next = *slot;
+  if (timer->next) timer->next->prev_next = &timer->next;
+  *slot = timer;
+  timer->prev_next = slot;
+}
+
+static void unlink_timer(Timer *timer) {
+  *timer->prev_next = timer->next;
+  if (timer->next) timer->next->prev_next = timer->prev_next;
+}
+
+static void add_to_wheel(Timer *timer) {
+  int64_t delta = timer->expires - timer_tick;
+  if (delta < 0) {
+    // The timer is overdue, so we run it with the next tick.
+    link_timer(timer, &wheel[0][timer_tick & slot_mask]);
+    return;
+  }
+  if (delta > max_ticks) {
+    timer->expires = timer_tick + max_ticks;
+    delta          = max_ticks;
+  }
+  int level = 0;
+  while (delta >= (int64_t)1 << (level_bits * (level + 1))) level++;
+  int slot = (timer->expires >> (level_bits * level)) & slot_mask;
+  link_timer(timer, &wheel[level][slot]);
+}
+
+static Timer *alloc_timer() {
+  if (free_list == NULL) {
+    if (num_chunks == max_chunks) return NULL;
+    Timer *chunk = calloc(timers_per_chunk, sizeof(Timer));
+    if (chunk == NULL) return NULL;
+    for (int i = timers_per_chunk - 1; i >= 0; --i) {
+      chunk[i].index = num_chunks * timers_per_chunk + i;
+      chunk[i].next  = free_list;
+      free_list      = chunk + i;
+    }
+    chunks[num_chunks++] = chunk;
+  }
+  Timer *timer = free_list;
+  free_list = timer->next;
+  timer->is_pending = 1;
+  num_pending++;
+  return timer;
+}
+
+static void free_timer(Timer *timer) {
+  timer->generation++;
+  timer->is_pending = 0;
+  timer->next = free_list;
+  free_list   = timer;
+  num_pending--;
+}
+
+// Handles are never 0, since the low half is the index + 1.
+static thready__Timer handle_of(Timer *timer) {
+  return ((thready__Timer)timer->generation << 32) | (timer->index + 1);
+}
+
+// Returns NULL if the handle is stale or was never valid.
+static Timer *timer_of(thready__Timer handle) {
+  uint32_t index      = (uint32_t)handle - 1;
+  uint32_t generation = (uint32_t)(handle >> 32);
+  if (index / timers_per_chunk >= (uint32_t)num_chunks) return NULL;
+  Timer *timer = chunks[index / timers_per_chunk] + index % timers_per_chunk;
+  if (!timer->is_pending || timer->generation != generation) return NULL;
+  return timer;
+}
+
+// Moves every timer in the given slot to the levels below it.
+static void cascade(int level, int slot) {
+  Timer *timer = wheel[level][slot];
+  wheel[level][slot] = NULL;
+  while (timer) {
+    Timer *next = timer->next;
+    add_to_wheel(timer);
+    timer = next;
+  }
+}
+
+static void run_tick() {
+  int slot = timer_tick & slot_mask;
+  for (int level = 1; slot == 0 && level < num_levels; ++level) {
+    slot = (timer_tick >> (level_bits * level)) & slot_mask;
+    cascade(level, slot);
+  }
+
+  Timer *timer = wheel[0][timer_tick & slot_mask];
+  wheel[0][timer_tick & slot_mask] = NULL;
+  timer_tick++;
+
+  while (timer) {
+    Timer *next = timer->next;
+    thready__Id result = inbox__force_send(timer->to, timer->msg, 0,
+                                           timer->from);
+    if (timer->period && result == thready__success) {
+      // If we've fallen behind, we skip the missed periods.
+      timer->expires += timer->period;
+      if (timer->expires < timer_tick) timer->expires = timer_tick;
+      add_to_wheel(timer);
+    } else {
+      free_timer(timer);
+    }
+    timer = next;
+  }
+}
+
+// Returns the next tick that may have work to do, or -1 if there are no
+// pending timers. Higher levels are only cascaded when level 0 wraps around,
+// so we look no further than that.
+static int64_t next_busy_tick() {
+  if (num_pending == 0) return -1;
+  for (int64_t tick = timer_tick;; ++tick) {
+    if ((tick & slot_mask) == 0 || wheel[0][tick & slot_mask]) return tick;
+  }
+}
+
+static void *timer_runner(void *unused) {
+  pthread_mutex_lock(&timer_mutex);
+  while (1) {
+    int64_t now = current_tick();
+    while (timer_tick <= now) run_tick();
+
+    wake_tick = next_busy_tick();
+    if (wake_tick == -1) {
+      pthread_cond_wait(&timer_signal, &timer_mutex);
+    } else {
+      int64_t wait_ns = start_ns + wake_tick * tick_ns - clock_ns();
+      if (wait_ns > 0) {
+        pthread_cond_wait_ns(&timer_signal, &timer_mutex, wait_ns);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Returns 0 if the thread couldn't be started, in which case the next timer
+// tries again. The caller must hold timer_mutex.
+static int start_timer_thread() {
+  start_ns = clock_ns();
+  pthread_t pthread;
+  int err = pthread_create(&pthread,        // receive thread id
+                           NULL,            // NULL --> use default attributes
+                           timer_runner,    // init function
+                           NULL);           // init function arg
+  timer_is_running = !err;
+  return timer_is_running;
+}
+
+static thready__Timer add_timer(void *msg, thready__Id to, int64_t delay_ns,
+                                int64_t period_ns) {
+  Thread *from = thread__current();
+  if (from == NULL || thread__of(to) == NULL || delay_ns < 0) return 0;
+
+  pthread_mutex_lock(&timer_mutex);
+  Timer *timer = NULL;
+  if (timer_is_running || start_timer_thread()) timer = alloc_timer();
+  if (timer == NULL) {
+    pthread_mutex_unlock(&timer_mutex);
+    return 0;
+  }
+
+  // With no pending timers, the timer thread may be asleep with an old
+  // timer_tick; catching it up here saves it from running every missed tick.
+  if (num_pending == 1) timer_tick = current_tick();
+
+  // Clamping first keeps the tick math below from overflowing.
+  if (delay_ns  > max_delay_ns) delay_ns  = max_delay_ns;
+  if (period_ns > max_delay_ns) period_ns = max_delay_ns;
+
+  // A timer never fires before its delay has passed.
+  timer->expires = (clock_ns() - start_ns + delay_ns + tick_ns - 1) / tick_ns;
+  timer->period  = (period_ns + tick_ns - 1) / tick_ns;
+  timer->msg     = msg;
+  timer->from    = from->id;
+  timer->to      = to;
+  add_to_wheel(timer);
+
+  if (wake_tick == -1 || timer->expires < wake_tick) {
+    pthread_cond_signal(&timer_signal);
+  }
+  thready__Timer handle = handle_of(timer);
+  pthread_mutex_unlock(&timer_mutex);
+  return handle;
+}
+
+
+// Public functions.
+
+thready__Timer thready__send_after(void *msg, thready__Id to,
+                                   int64_t delay_ns) {
+  return add_timer(msg, to, delay_ns, 0);
+}
+
+thready__Timer thready__send_every(void *msg, thready__Id to,
+                                   int64_t period_ns) {
+  if (period_ns <= 0) return 0;
+  return add_timer(msg, to, period_ns, period_ns);
+}
+
+thready__Id thready__cancel_timer(thready__Timer handle) {
+  if (handle == 0) return thready__error;
+  pthread_mutex_lock(&timer_mutex);
+  Timer *timer = timer_of(handle);
+  if (timer) {
+    unlink_timer(timer);
+    free_timer(timer);
+  }
+  pthread_mutex_unlock(&timer_mutex);
+  return timer ? thready__success : thready__error;
+}
@@ -0,0 +1,174 @@
+// topic.c
+//
+// https://github.com/tylerneylon/thready
+//
+// Publish/subscribe topics and the reference-counted payloads they deliver.
+//
+// A shared payload is a block from thready__msg_alloc that starts with a
+// reference count. Publishing sends the same payload pointer to every
+// subscriber, adding one reference for each, so a message goes to any number
+// of subscribers without being copied. Each receiver releases its reference,
+// and the last release frees the block.
+//
+// A topic's subscribers are kept in an immutable array that's replaced
+// whenever someone subscribes or unsubscribes. A publisher holds a reference
+// to the array it started with, so it can send without holding the topic's
+// lock; that keeps a publisher blocked on a full inbox from also blocking
+// subscription changes.
+//
+
+#include "internal.h"
+
+#include <stdlib.h>
+
+
+// Internal types.
+
+// This keeps payloads 16-byte aligned, like malloc's.
+#define header_size 16
+
+typedef struct {
+  int           num_owners;  // The topic, plus each publish in progress.
+  int           num_ids;
+  thready__Id   ids[];
+} Subscribers;
+
+struct thready__Topic {
+  pthread_mutex_t  mutex;
+  Subscribers *    subscribers;  // Never NULL.
+};
+
+
+// Internal functions.
+
+static int *num_refs_of(void *shared) {
+  return (int *)((char *)shared - header_size);
+}
+
+static Subscribers *new_subscribers(int num_ids) {
+  Subscribers *subscribers = malloc(sizeof(Subscribers) +
+                                    num_ids * sizeof(thready__Id));
+  if (subscribers == NULL) return NULL;
+  subscribers->num_owners = 1;
+  subscribers->num_ids    = num_ids;
+  return subscribers;
+}
+
+static void release_subscribers(Subscribers *subscribers) {
+  if (atomic__add(&subscribers->num_owners, -1) == 1) free(subscribers);
+}
+
+static int index_of(Subscribers *subscribers, thready__Id id) {
+  for (int i = 0; i < subscribers->num_ids; ++i) {
+    if (subscribers->ids[i] == id) return i;
+  }
+  return -1;
+}
+
+// The caller must hold topic->mutex.
+static void replace_subscribers(thready__Topic *topic,
+                                Subscribers *subscribers) {
+  release_subscribers(topic->subscribers);
+  topic->subscribers = subscribers;
+}
+
+
+// Public functions.
+
+void *thready__shared_alloc(size_t size) {
+  char *block = thready__msg_alloc(header_size + size);
+  if (block == NULL) return NULL;
+  *(int *)block = 1;
+  return block + header_size;
+}
+
+void thready__shared_retain(void *shared) {
+  atomic__add(num_refs_of(shared), 1);
+}
+
+void thready__shared_release(void *shared) {
+  if (shared == NULL) return;
+  int *num_refs = num_refs_of(shared);
+  if (atomic__add(num_refs, -1) == 1) thready__msg_free(num_refs);
+}
+
+thready__Topic *thready__topic_new() {
+  thready__Topic *topic = malloc(sizeof(thready__Topic));
+  if (topic == NULL) return NULL;
+  topic->subscribers = new_subscribers(0);
+  if (topic->subscribers == NULL) {
+    free(topic);
+    return NULL;
+  }
+  pthread_mutex_init(&topic->mutex, NULL);
+  return topic;
+}
+
+void thready__topic_delete(thready__Topic *topic) {
+  if (topic == NULL) return;
+  release_subscribers(topic->subscribers);
+  pthread_mutex_destroy(&topic->mutex);
+  free(topic);
+}
+
+thready__Id thready__topic_subscribe(thready__Topic *topic, thready__Id id) {
+  if (topic == NULL || id == NULL) return thready__error;
+
+  pthread_mutex_lock(&topic->mutex);
+  Subscribers *prev = topic->subscribers;
+  Subscribers *next = NULL;
+  if (index_of(prev, id) == -1) next = new_subscribers(prev->num_ids + 1);
+  if (next) {
+    for (int i = 0; i < prev->num_ids; ++i) next->ids[i] = prev->ids[i];
+    next->ids[prev->num_ids] = id;
+    replace_subscribers(topic, next);
+  }
+  pthread_mutex_unlock(&topic->mutex);
+
+  return next ? thready__success : thready__error;
+}
+
+thready__Id thready__topic_unsubscribe(thready__Topic *topic, thready__Id id) {
+  if (topic == NULL) return thready__error;
+
+  pthread_mutex_lock(&topic->mutex);
+  Subscribers *prev = topic->subscribers;
+  Subscribers *next = NULL;
+  int index = index_of(prev, id);
+  if (index != -1) next = new_subscribers(prev->num_ids - 1);
+  if (next) {
+    for (int i = 0, j = 0; i < prev->num_ids; ++i) {
+      if (i != index) next->ids[j++] = prev->ids[i];
+    }
+    replace_subscribers(topic, next);
+  }
+  pthread_mutex_unlock(&topic->mutex);
+
+  return next ? thready__success : thready__error;
+}
+
+int thready__topic_publish(thready__Topic *topic, void *shared) {
+  if (topic == NULL || shared == NULL) return 0;
+
+  pthread_mutex_lock(&topic->mutex);
+  Subscribers *subscribers = topic->subscribers;
+  atomic__add(&subscribers->num_owners, 1);
+  pthread_mutex_unlock(&topic->mutex);
+
+  // One atomic add covers every subscriber's reference; failed sends give
+  // theirs back.
+  int num_ids = subscribers->num_ids;
+  atomic__add(num_refs_of(shared), num_ids);
+
+  int num_sent = 0;
+  for (int i = 0; i < num_ids; ++i) {
+    if (thready__send(shared, subscribers->ids[i]) == thready__success) {
+      num_sent++;
+    } else {
+      thready__shared_release(shared);
+    }
+  }
+
+  release_subscribers(subscribers);
+  return num_sent;
+}
@@ -0,0 +1,272 @@
+// trace.c
+//
+// https://github.com/tylerneylon/thready
+//
+// Event tracing for thready__trace_start, thready__trace_stop and
+// thready__trace_write.
+//
+// Each OS thread records events into its own ring buffer, so recording takes
+// no locks and no atomic read-modify-writes: it's a read of cpu_ticks and a
+// few stores. Ticks are converted to time when the trace is written, using
+// clock_ns samples from the start of the session and from the write. When a
+// ring is full, new events overwrite the oldest ones. While tracing is off,
+// each trace point costs a single load and branch.
+//
+// Every call to thready__trace_start begins a new session. A ring notices the
+// new session the next time its thread records an event, and starts over; the
+// rings of threads that haven't recorded anything since are left out of
+// thready__trace_write. Rings are never freed. When a thread exits, its ring is
+// adopted by the next new thread that records an event.
+//
+// The output is the json trace event format read by chrome://tracing and
+// ui.perfetto.dev. Each thread or actor gets its own row, with its receiver
+// calls shown as slices and its sends and dequeues as instant events.
+//
+
+#include "internal.h"
+
+#include "../cstructs/cstructs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Internal types.
+
+#define default_events_per_thread 16384
+
+typedef struct {
+  int64_t     ticks;    // From cpu_ticks.
+  thready__Id id;       // The thread or actor the event happened to.
+  thready__Id other;    // The receiver of a send, or the sender of a message.
+  int         type;     // One of the trace__* event types.
+  int         count;    // The number of messages sent or dequeued.
+  char        name[16]; // The thread's name; only for trace__handler_begin.
+} Event;
+
+typedef struct Ring {
+  // These are written by the owning thread.
+  Event *       events;
+  int           capacity;    // A power of 2.
+  uint64_t      num_events;  // Recorded in this ring's session, including
+                             // any that were overwritten.
+  int           session;     // When this ring was last started over.
+
+  // These are guarded by rings_mutex.
+  struct Ring * next;
+  int           is_orphan;
+} Ring;
+
+
+// Internal data.
+
+int                     trace__is_on       = 0;
+
+static int              session            = 0;
+static int              events_per_thread  = default_events_per_thread;
+static int64_t          start_ns;     // The session's start, by clock_ns.
+static int64_t          start_ticks;  // The same moment, by cpu_ticks.
+
+static Ring *           rings              = NULL;
+static pthread_mutex_t  rings_mutex        = PTHREAD_MUTEX_INITIALIZER;
+
+static thread_local Ring *current_ring     = NULL;
+
+
+// Internal functions.
+
+static int hash(void *v) {
+  return (int)(intptr_t)v;
+}
+
+static int eq(void *v1, void *v2) {
+  return v1 == v2;
+}
+
+static Ring *get_ring() {
+  if (current_ring) return current_ring;
+
+  pthread_mutex_lock(&rings_mutex);
+  for (Ring *ring = rings; ring; ring = ring->next) {
+    if (ring->is_orphan) {
+      ring->is_orphan = 0;
+      current_ring    = ring;
+      break;
+    }
+  }
+  if (current_ring == NULL) {
+    current_ring = calloc(1, sizeof(Ring));
+    if (current_ring) {
+      current_ring->next = rings;
+      rings = current_ring;
+    }
+  }
+  pthread_mutex_unlock(&rings_mutex);
+
+  return current_ring;
+}
+
+// Empties the ring for the current session. Returns 0 if the ring has no
+// memory for events.
+static int start_session(Ring *ring, int new_session) {
+  int capacity = atomic__load_relaxed(&events_per_thread);
+  if (ring->capacity != capacity) {
+    free(ring->events);
+    ring->events   = malloc(capacity * sizeof(Event));
+    ring->capacity = ring->events ? capacity : 0;
+  }
+  atomic__store_relaxed(&ring->num_events, 0);
+  atomic__store_rel(&ring->session, new_session);
+  return ring->events != NULL;
+}
+
+// Writes up to 15 characters of the name as the contents of a json string.
+static void write_name(FILE *file, const char *name) {
+  for (int i = 0; i < 15 && name[i]; ++i) {
+    unsigned char c = name[i];
+    if (c == '"' || c == '\\') {
+      fprintf(file, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(file, "\\u%04x", c);
+    } else {
+      fputc(c, file);
+    }
+  }
+}
+
+static void write_event(FILE *file, Event *event, double us_per_tick,
+                        Map names) {
+  double ts = (event->ticks - start_ticks) * us_per_tick;
+  unsigned long long tid   = (uintptr_t)event->id;
+  unsigned long long other = (uintptr_t)event->other;
+
+  switch (event->type) {
+    case trace__send:
+    case trace__enqueue:
+      fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,"
+              "\"tid\":%llu,\"ts\":%.3f,\"args\":{\"to\":%llu,\"count\":%d}}",
+              event->type == trace__send ? "send" : "enqueue",
+              tid, ts, other, event->count);
+      break;
+    case trace__dequeue:
+      fprintf(file, ",\n{\"name\":\"dequeue\",\"ph\":\"i\",\"s\":\"t\","
+              "\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"args\":{\"count\":%d}}",
+              tid, ts, event->count);
+      break;
+    case trace__handler_begin:
+      if (event->name[0] && map__get(names, event->id) == NULL) {
+        map__set(names, event->id, event->id);
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%llu,\"args\":{\"name\":\"", tid);
+        write_name(file, event->name);
+        fprintf(file, "\"}}");
+      }
+      fprintf(file, ",\n{\"name\":\"receive\",\"ph\":\"B\",\"pid\":1,"
+              "\"tid\":%llu,\"ts\":%.3f,\"args\":{\"from\":%llu}}",
+              tid, ts, other);
+      break;
+    case trace__handler_end:
+      fprintf(file, ",\n{\"ph\":\"E\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f}",
+              tid, ts);
+      break;
+  }
+}
+
+
+// Functions shared with other files.
+
+void trace__record(int type, thready__Id id, thready__Id other, int count,
+                   const char *name) {
+  Ring *ring = get_ring();
+  if (ring == NULL) return;
+
+  int current_session = atomic__load_relaxed(&session);
+  if (ring->session != current_session &&
+      !start_session(ring, current_session)) {
+    return;
+  }
+
+  uint64_t n   = ring->num_events;
+  Event *event = ring->events + (n & (ring->capacity - 1));
+  event->ticks   = cpu_ticks();
+  event->id      = id;
+  event->other   = other;
+  event->type    = type;
+  event->count   = count;
+  if (type == trace__handler_begin) {
+    memcpy(event->name, name, sizeof(event->name));
+  }
+  atomic__store_rel(&ring->num_events, n + 1);
+}
+
+void trace__release() {
+  if (current_ring == NULL) return;
+  pthread_mutex_lock(&rings_mutex);
+  current_ring->is_orphan = 1;
+  pthread_mutex_unlock(&rings_mutex);
+  current_ring = NULL;
+}
+
+
+// Public functions.
+
+thready__Id thready__trace_start(int num_events) {
+  if (num_events < 0) return thready__error;
+  if (num_events == 0) num_events = default_events_per_thread;
+
+  // Rings index events with a mask, so we round up to a power of 2.
+  int capacity = 1;
+  while (capacity < num_events) {
+    if (capacity > INT32_MAX / 2 / (int)sizeof(Event)) return thready__error;
+    capacity *= 2;
+  }
+
+  pthread_mutex_lock(&rings_mutex);
+  atomic__store_relaxed(&events_per_thread, capacity);
+  start_ns    = clock_ns();
+  start_ticks = cpu_ticks();
+  atomic__store(&session, session + 1);
+  atomic__store(&trace__is_on, 1);
+  pthread_mutex_unlock(&rings_mutex);
+
+  return thready__success;
+}
+
+void thready__trace_stop() {
+  atomic__store(&trace__is_on, 0);
+}
+
+thready__Id thready__trace_write(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) return thready__error;
+
+  Map names = map__new(hash, eq);  // The threads we've written names for.
+
+  // The metadata event lets every later event start with a comma.
+  fprintf(file, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\","
+          "\"pid\":1,\"args\":{\"name\":\"thready\"}}");
+
+  pthread_mutex_lock(&rings_mutex);
+  int current_session = session;
+
+  // Timestamps are in microseconds from the start of the session.
+  int64_t ticks = cpu_ticks() - start_ticks;
+  double us_per_tick = ticks > 0 ? (clock_ns() - start_ns) / 1000.0 / ticks : 0;
+
+  for (Ring *ring = rings; ring; ring = ring->next) {
+    if (atomic__load_acq(&ring->session) != current_session) continue;
+    uint64_t n     = atomic__load_acq(&ring->num_events);
+    uint64_t first = n > (uint64_t)ring->capacity ? n - ring->capacity : 0;
+    for (uint64_t i = first; i < n; ++i) {
+      write_event(file, ring->events + (i & (ring->capacity - 1)),
+                  us_per_tick, names);
+    }
+  }
+  pthread_mutex_unlock(&rings_mutex);
+
+  fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  map__delete(names);
+
+  return fclose(file) == 0 ? thready__success : thready__error;
+}